@@ -1,262 +1,1649 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <strings.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "shortener.h"
 
-#define LONG_URL_MAX 1024
-#define SHORT_CODE_LEN 7
-#define HASH_SIZE 1009
+/* The CLI, the HTTP redirect server and the benchmarks, all on one store
+   from libshortener (shortener.c).
+*/
+static shortener_t *store;
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void cleanup_all() {
+    shortener_destroy(store);
+    store = NULL;
+    printf("Clean-Up Done!!\nExiting Code...\n");
+}
+
+/* HTTP redirect server (--serve [ADDR:]PORT): answers GET /<code> with a
+   redirect to the stored URL from one non-blocking epoll loop. Requests are
+   parsed in place in the connection's input buffer, and every complete
+   request a read brought in is answered before one send of all the
+   responses, so pipelined requests share their syscalls. Connections stay
+   open unless the client asks to close them or speaks HTTP/1.0 without
+   keep-alive. A connection with unsent responses is not read from until they
+   are out. Between batches of events the loop does the CLI's idle work.
+   --backend picks how the loop waits for sockets: io_uring (below; the
+   default, falling back to epoll where the kernel lacks it) or epoll.
+   POST / with a URL as the body shortens it and answers with the code.
+*/
+#define HTTP_IN_BYTES 8192      // largest request head accepted
+#define HTTP_EVENTS 256
+#define SERVE_IDLE_MS 100       // epoll timeout while no idle work is left
+#define SERVE_MAX_THREADS 64
+#define SERVE_SHARED_IDLE_MS 10 // with several threads, idle work runs at most this often
+// status line and headers around the URL in the largest response
+#define HTTP_RESPONSE_MAX (SHORTENER_URL_MAX + 256)
+
+enum { BACKEND_EPOLL, BACKEND_URING };
+
+typedef struct HttpConn {
+    int fd;
+    int closing;        // close once out is sent
+    int writing;        // epoll: waiting for EPOLLOUT instead of EPOLLIN
+    size_t in_len;
+    char *out;
+    size_t out_len;
+    size_t out_pos;
+    size_t out_cap;
+    char *wire;         // io_uring: the responses a send is in flight for
+    size_t wire_len;
+    size_t wire_pos;
+    size_t wire_cap;
+    int ops;            // io_uring: operations the kernel still holds
+    int recv_armed;
+    int sending;
+    int throttled;      // a cancel of the recv is on its way
+    int dead;           // shut down, freed once ops reaches 0
+    int queued;         // on the send queue
+    struct HttpConn *send_next;
+    struct HttpConn *prev, *next;
+    char in[HTTP_IN_BYTES];
+} HttpConn;
+
+typedef struct HttpServer {
+    int epfd;
+    int listen_fd;
+    int status;         // 301 or 302 (--redirect)
+    int backend;        // --backend
+    const char *redirect; // its status line, up to the Location value
+    HttpConn *conns;
+    uint64_t requests;
+    uint64_t redirects;
+    uint64_t shortened;
+    uint64_t connections;
+    uint64_t syscalls;  // made by the server loop, for the load test
+} HttpServer;
 
-static const char *BASE62 = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+static __thread HttpServer http = { .epfd = -1, .listen_fd = -1, .status = 301, .backend = BACKEND_URING };
+static int serve_stop; // set by SIGINT or SIGTERM, read by every server thread
 
-// Scrambling configuration to avoid linear short codes
-#define MODULUS (1099511627776ULL)     // 2^40 space (~1.1 trillion unique codes) 
-#define PRIME_MULTIPLIER (36779219ULL)
+/* --threads N: N server threads, each with its own SO_REUSEPORT listener,
+   event loop and connections (http and uring are per thread), so the kernel
+   spreads connections over them and no connection state is shared. They all
+   call into the one store: redirects look codes up without taking a lock,
+   and a POST or idle work (which only thread 0 does) takes shard locks.
+*/
+static int serve_threads = 1;
+static __thread int serve_id;   // this thread's index, 0 for the main thread
+
+// Idle work between batches of events; returns how long the loop may then wait, in ms
+static int serve_idle() {
+    if (serve_threads == 1) return shortener_idle(store) ? 0 : SERVE_IDLE_MS;
+    if (serve_id != 0) return SERVE_IDLE_MS;
+    static double last;
+    static int more;
+    double t = now_sec();
+    if (t - last >= SERVE_SHARED_IDLE_MS / 1000.0) {
+        more = shortener_idle(store);
+        last = t;
+    }
+    return more ? SERVE_SHARED_IDLE_MS : SERVE_IDLE_MS;
+}
+
+static void serve_on_signal(int sig) {
+    (void)sig;
+    __atomic_store_n(&serve_stop, 1, __ATOMIC_RELAXED);
+}
+
+// Room for one more response of any kind
+static void http_reserve(HttpConn *c) {
+    if (c->out_cap - c->out_len >= HTTP_RESPONSE_MAX) return;
+    c->out_cap = c->out_cap * 2 > c->out_len + HTTP_RESPONSE_MAX ? c->out_cap * 2 : c->out_len + HTTP_RESPONSE_MAX;
+    c->out = realloc(c->out, c->out_cap);
+    if (!c->out) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+}
+
+static void http_append(HttpConn *c, const char *s, size_t n) {
+    memcpy(c->out + c->out_len, s, n);
+    c->out_len += n;
+}
+
+#define HTTP_APPEND_LIT(c, s) http_append(c, s, sizeof(s) - 1)
+
+// Case-insensitive match of header line p..end against "name:"; returns the value start
+static const char *http_header(const char *p, const char *end, const char *name) {
+    size_t n = strlen(name);
+    if ((size_t)(end - p) <= n || p[n] != ':' || strncasecmp(p, name, n) != 0) return NULL;
+    for (p += n + 1; p < end && (*p == ' ' || *p == '\t'); ++p) {}
+    return p;
+}
+
+static int http_token(const char *p, const char *end, const char *token) {
+    size_t n = strlen(token);
+    for (; (size_t)(end - p) >= n; ++p)
+        if (strncasecmp(p, token, n) == 0) return 1;
+    return 0;
+}
+
+/* POST / (target t..te): shorten the URL that is the body, n bytes at p,
+   answering with its code and a newline
+*/
+static void http_shorten(HttpConn *c, const char *t, const char *te, const char *p, size_t n) {
+    char code[SHORTENER_CODE_LEN];
+    while (n && (p[n - 1] == '\n' || p[n - 1] == '\r')) n--;
+    int valid = n > 0 && n < SHORTENER_URL_MAX;
+    for (size_t i = 0; valid && i < n; ++i)
+        if ((unsigned char)p[i] < 0x20) valid = 0; // it must fit in a Location header
+    int ok = 0;
+    if (te - t != 1 || *t != '/') {
+        HTTP_APPEND_LIT(c, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n");
+    } else if (!valid) {
+        HTTP_APPEND_LIT(c, "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n");
+    } else {
+        ok = shortener_gen(store, p, n, code) > 0;
+        if (ok) {
+            HTTP_APPEND_LIT(c, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 8\r\n");
+            http.shortened++;
+        } else {
+            HTTP_APPEND_LIT(c, "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n");
+        }
+    }
+    if (c->closing) HTTP_APPEND_LIT(c, "Connection: close\r\n");
+    HTTP_APPEND_LIT(c, "\r\n");
+    if (ok) {
+        http_append(c, code, SHORTENER_CODE_LEN);
+        HTTP_APPEND_LIT(c, "\n");
+    }
+}
+
+/* Answer the request whose head is p..p+n (ending in the blank line), with
+   avail more bytes received after it: the response goes into c->out, and
+   c->closing is set if the connection must close after it. Returns the
+   length of the body that followed the head, or -1 if the body of a POST
+   has not all arrived yet.
+*/
+static long http_handle(HttpConn *c, const char *p, size_t n, size_t avail) {
+    const char *end = p + n;
+    const char *eol = memchr(p, '\n', n);
+    const char *line_end = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+    http_reserve(c);
+
+    // request line: METHOD SP target SP HTTP/1.x; no GET response has a body, so HEAD is GET
+    const char *t;
+    int post = 0;
+    if (line_end - p > 4 && memcmp(p, "GET ", 4) == 0) {
+        t = p + 4;
+    } else if (line_end - p > 5 && memcmp(p, "HEAD ", 5) == 0) {
+        t = p + 5;
+    } else if (line_end - p > 5 && memcmp(p, "POST ", 5) == 0) {
+        t = p + 5;
+        post = 1;
+    } else {
+        http.requests++;
+        HTTP_APPEND_LIT(c, "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET, HEAD, POST\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        c->closing = 1;
+        return 0;
+    }
+    const char *te = memchr(t, ' ', (size_t)(line_end - t));
+    if (!te || line_end - te != 9 || memcmp(te + 1, "HTTP/1.", 7) != 0 || (te[8] != '0' && te[8] != '1')) {
+        http.requests++;
+        HTTP_APPEND_LIT(c, "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        c->closing = 1;
+        return 0;
+    }
+    int keep_alive = te[8] == '1';
 
-static uint64_t scramble_id(uint64_t sequential_id) {
-    if (sequential_id >= MODULUS) {
+    // only the headers that decide framing and keep-alive matter
+    long body = -1;
+    for (const char *h = eol + 1; h < end;) {
+        const char *he = memchr(h, '\n', (size_t)(end - h));
+        const char *v;
+        char *ve;
+        if ((v = http_header(h, he, "Connection"))) {
+            if (http_token(v, he, "close")) keep_alive = 0;
+            else if (http_token(v, he, "keep-alive")) keep_alive = 1;
+        } else if ((v = http_header(h, he, "Content-Length"))) {
+            body = strtol(v, &ve, 10);
+            if (ve == v || body < 0 || (body > 0 && !post)) body = -2;
+        } else if (http_header(h, he, "Transfer-Encoding")) {
+            body = -2;
+        }
+        if (body == -2) {
+            // a request body this parser cannot frame, or a GET with one
+            http.requests++;
+            HTTP_APPEND_LIT(c, "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+            c->closing = 1;
+            return 0;
+        }
+        h = he + 1;
+    }
+    if (post && body < 0) {
+        http.requests++;
+        HTTP_APPEND_LIT(c, "HTTP/1.1 411 Length Required\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        c->closing = 1;
         return 0;
     }
-    uint64_t scrambled_id = (sequential_id * PRIME_MULTIPLIER) % MODULUS;
-    return scrambled_id;
+    if (post && (size_t)body > avail) {
+        if (n + (size_t)body <= HTTP_IN_BYTES) return -1;
+        http.requests++;
+        HTTP_APPEND_LIT(c, "HTTP/1.1 413 Content Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        c->closing = 1;
+        return 0;
+    }
+    http.requests++;
+    if (!keep_alive) c->closing = 1;
+    if (post) {
+        http_shorten(c, t, te, end, (size_t)body);
+        return body;
+    }
+
+    // target: /<code>, optionally followed by a query. The status line goes
+    // out first and the URL is decoded right behind it.
+    char *start = c->out + c->out_len;
+    size_t sl = strlen(http.redirect);
+    memcpy(start, http.redirect, sl);
+    char *url = start + sl;
+    long len = -1;
+    if (te - t > SHORTENER_CODE_LEN && t[0] == '/' &&
+        (te - t == SHORTENER_CODE_LEN + 1 || t[SHORTENER_CODE_LEN + 1] == '?')) {
+        // http_reserve left room for any URL
+        len = shortener_get(store, t + 1, SHORTENER_CODE_LEN, url, c->out_cap - c->out_len - sl);
+        // a stored CR or LF would split the Location header
+        if (len >= 0 && (memchr(url, '\r', (size_t)len) || memchr(url, '\n', (size_t)len))) len = -1;
+    }
+    if (len < 0) {
+        HTTP_APPEND_LIT(c, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n");
+    } else {
+        c->out_len += sl + (size_t)len;
+        HTTP_APPEND_LIT(c, "\r\nContent-Length: 0\r\n");
+        http.redirects++;
+    }
+    if (c->closing) HTTP_APPEND_LIT(c, "Connection: close\r\n");
+    HTTP_APPEND_LIT(c, "\r\n");
+    return 0;
+}
+
+// Send what is queued; returns -1 once the connection should be closed
+static int http_send(HttpConn *c) {
+    while (c->out_pos < c->out_len) {
+        ssize_t w = send(c->fd, c->out + c->out_pos, c->out_len - c->out_pos, MSG_NOSIGNAL);
+        http.syscalls++;
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        c->out_pos += (size_t)w;
+    }
+    c->out_pos = c->out_len = 0;
+    return c->closing ? -1 : 0;
 }
 
-/* Single node used in both hash tables.
-   Each node has two 'next' pointers: one for short-table chaining and one for long-table chaining.
+// Answer every complete request in c->in, keeping a partial one for later
+static void http_consume(HttpConn *c) {
+    size_t pos = 0;
+    while (!c->closing) {
+        // a head ends at the first empty line
+        const char *head = c->in + pos, *e = NULL;
+        for (const char *q = head; (q = memchr(q, '\n', (size_t)(c->in + c->in_len - q))); ++q) {
+            if (q + 2 < c->in + c->in_len && q[1] == '\r' && q[2] == '\n') {
+                e = q + 3;
+                break;
+            }
+            if (q + 1 < c->in + c->in_len && q[1] == '\n') {
+                e = q + 2;
+                break;
+            }
+        }
+        if (!e) break;
+        long body = http_handle(c, head, (size_t)(e - head), (size_t)(c->in + c->in_len - e));
+        if (body < 0) break; // the rest of a POST body is still to come
+        pos = (size_t)(e - c->in) + (size_t)body;
+    }
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+    if (c->in_len == HTTP_IN_BYTES && !c->closing) {
+        http_reserve(c);
+        HTTP_APPEND_LIT(c, "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        c->closing = 1;
+    }
+}
+
+// Take n received bytes at p (io_uring hands them over in its own buffers)
+static void http_feed(HttpConn *c, const char *p, size_t n) {
+    while (n && !c->closing) {
+        size_t k = HTTP_IN_BYTES - c->in_len < n ? HTTP_IN_BYTES - c->in_len : n;
+        memcpy(c->in + c->in_len, p, k);
+        c->in_len += k;
+        p += k;
+        n -= k;
+        http_consume(c);
+    }
+}
+
+// Read and answer requests until the socket is drained or a send would block
+static int http_read(HttpConn *c) {
+    while (!c->closing) {
+        ssize_t r = recv(c->fd, c->in + c->in_len, HTTP_IN_BYTES - c->in_len, 0);
+        http.syscalls++;
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        if (r == 0) {
+            // the client is done sending; answer what it sent, then close
+            c->closing = 1;
+            break;
+        }
+        c->in_len += (size_t)r;
+        http_consume(c);
+        if (http_send(c) < 0) return -1;
+        if (c->out_len) break;
+    }
+    return http_send(c);
+}
+
+static void http_close(HttpConn *c) {
+    close(c->fd);
+    http.syscalls++;
+    if (c->prev) c->prev->next = c->next;
+    else http.conns = c->next;
+    if (c->next) c->next->prev = c->prev;
+    free(c->out);
+    free(c->wire);
+    free(c);
+}
+
+static HttpConn *http_new_conn(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    http.syscalls++;
+    HttpConn *c = calloc(1, sizeof(HttpConn));
+    if (!c) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    c->fd = fd;
+    c->next = http.conns;
+    if (c->next) c->next->prev = c;
+    http.conns = c;
+    http.connections++;
+    return c;
+}
+
+// Wait for room to send while responses are queued, for requests otherwise
+static void http_watch(HttpConn *c) {
+    int writing = c->out_len != 0;
+    if (writing == c->writing) return;
+    struct epoll_event ev = { .events = writing ? EPOLLOUT : EPOLLIN, .data.ptr = c };
+    epoll_ctl(http.epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    http.syscalls++;
+    c->writing = writing;
+}
+
+static void http_accept() {
+    for (;;) {
+        int fd = accept4(http.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        http.syscalls++;
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        HttpConn *c = http_new_conn(fd);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        http.syscalls++;
+        if (epoll_ctl(http.epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            perror("epoll_ctl");
+            http_close(c);
+        }
+    }
+}
+
+static void serve_epoll() {
+    http.epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event lev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (http.epfd < 0 || epoll_ctl(http.epfd, EPOLL_CTL_ADD, http.listen_fd, &lev) != 0) {
+        perror("epoll");
+        exit(1);
+    }
+    struct epoll_event events[HTTP_EVENTS];
+    int timeout = 0;
+    while (!__atomic_load_n(&serve_stop, __ATOMIC_RELAXED)) {
+        int n = epoll_wait(http.epfd, events, HTTP_EVENTS, timeout);
+        http.syscalls++;
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            HttpConn *c = events[i].data.ptr;
+            if (!c) {
+                http_accept();
+                continue;
+            }
+            int r = events[i].events & EPOLLERR ? -1
+                    : c->writing               ? http_send(c)
+                                               : http_read(c);
+            if (r < 0) http_close(c);
+            else http_watch(c);
+        }
+        timeout = serve_idle();
+    }
+    while (http.conns) http_close(http.conns);
+    close(http.epfd);
+    http.epfd = -1;
+}
+
+#ifdef IORING_RECV_MULTISHOT
+/* io_uring backend (--backend uring, the default): the same connections and
+   parser, but one io_uring_enter per loop submits everything the last batch
+   of completions queued and collects the next batch. A multishot accept
+   hands over new connections, and each connection has a multishot recv
+   that fills buffers from a ring registered with the kernel; the bytes are
+   copied into the connection's input buffer and the buffer goes straight
+   back. Responses are sent from a second buffer (wire) so the parser can
+   keep filling out while a send is in flight; a connection with more than
+   HTTP_OUT_MAX queued has its recv cancelled until the send catches up.
+   Needs Linux 5.19; before 6.0 recv is re-armed after every read.
 */
-typedef struct Node {
-    char short_code[SHORT_CODE_LEN + 1];
-    char *long_url;
-    struct Node *next_short; 
-    struct Node *next_long;  
-} Node;
-
-//Two hash-tables pointing to the same nodes (no duplicate payloads).
-static Node *short_table[HASH_SIZE];
-static Node *long_table[HASH_SIZE];
-
-//global counter for generating unique IDs 
-static uint64_t global_id = 1;
-
-// djb2 hashing 
-unsigned long hash_str(const char *str) {
-    unsigned long hash = 5381;
-    unsigned char c;
-    while ((c = (unsigned char)*str++))
-        hash = ((hash << 5) + hash) + c;
-    return hash % HASH_SIZE;
-}
-
-// encode integer id to base62 fixed-length short code
-void id_to_base62(uint64_t id, char *out) {
-    char buf[SHORT_CODE_LEN + 1];
-    buf[SHORT_CODE_LEN] = '\0';
-    for (int i = SHORT_CODE_LEN - 1; i >= 0; --i) {
-        buf[i] = BASE62[id % 62];
-        id /= 62;
-    }
-    strcpy(out, buf);
-}
-
-// find node by short code (traverse short_table via next_short) 
-Node *find_by_short(const char *short_code) {
-    unsigned long h = hash_str(short_code);
-    Node *cur = short_table[h];
-    while (cur) {
-        if (strcmp(cur->short_code, short_code) == 0) return cur;
-        cur = cur->next_short;
+#define URING_ENTRIES 1024
+#define URING_BUFS 1024         // provided receive buffers, a power of two
+#define URING_BUF_BYTES 4096
+#define URING_BGID 0
+#define HTTP_OUT_MAX (256 * 1024)
+
+// user_data: the connection with the operation in its low bits (NULL for the listener)
+enum { OP_ACCEPT, OP_RECV, OP_SEND, OP_CANCEL };
+
+typedef struct Uring {
+    int fd;
+    void *ring;
+    size_t ring_bytes;
+    struct io_uring_sqe *sqes;
+    size_t sqe_bytes;
+    unsigned *sq_head, *sq_tail, *sq_array;
+    unsigned sq_mask, sq_entries;
+    unsigned sq_local;  // tail including prepared, unpublished entries
+    unsigned *cq_head, *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *br;
+    size_t br_bytes;
+    uint16_t br_tail;
+    char *bufs;
+    int recv_multishot;
+    int accept_multishot;
+    HttpConn *send_queue; // connections with responses waiting for a send
+} Uring;
+
+static __thread Uring uring = { .fd = -1 };
+
+static int uring_enter(unsigned wait, int timeout_ms) {
+    __atomic_store_n(uring.sq_tail, uring.sq_local, __ATOMIC_RELEASE);
+    unsigned pending = uring.sq_local - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+    struct __kernel_timespec ts = { .tv_sec = timeout_ms / 1000, .tv_nsec = timeout_ms % 1000 * 1000000L };
+    struct io_uring_getevents_arg arg = { .ts = (uint64_t)(uintptr_t)&ts };
+    http.syscalls++;
+    return (int)syscall(__NR_io_uring_enter, uring.fd, pending, wait,
+                        IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+static struct io_uring_sqe *uring_sqe(HttpConn *c, int op) {
+    // a full queue is submitted early; completions wait for the next reap
+    while (uring.sq_local - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) == uring.sq_entries)
+        uring_enter(0, 0);
+    unsigned i = uring.sq_local++ & uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    uring.sq_array[i] = i;
+    sqe->user_data = (uint64_t)(uintptr_t)c | (uint64_t)op;
+    return sqe;
+}
+
+static void uring_accept() {
+    struct io_uring_sqe *sqe = uring_sqe(NULL, OP_ACCEPT);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = http.listen_fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = uring.accept_multishot ? IORING_ACCEPT_MULTISHOT : 0;
+}
+
+static void uring_recv(HttpConn *c) {
+    struct io_uring_sqe *sqe = uring_sqe(c, OP_RECV);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->ioprio = uring.recv_multishot ? IORING_RECV_MULTISHOT : 0;
+    sqe->len = uring.recv_multishot ? 0 : URING_BUF_BYTES;
+    c->recv_armed = 1;
+    c->ops++;
+}
+
+static void uring_send(HttpConn *c) {
+    struct io_uring_sqe *sqe = uring_sqe(c, OP_SEND);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(c->wire + c->wire_pos);
+    sqe->len = (unsigned)(c->wire_len - c->wire_pos);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    c->sending = 1;
+    c->ops++;
+}
+
+// Stop the recv of a connection that has queued too much output
+static void uring_throttle(HttpConn *c) {
+    struct io_uring_sqe *sqe = uring_sqe(NULL, OP_CANCEL);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t)(uintptr_t)c | OP_RECV;
+    c->throttled = 1;
+}
+
+static void uring_recycle(unsigned bid) {
+    struct io_uring_buf *b = &uring.br->bufs[uring.br_tail & (URING_BUFS - 1)];
+    b->addr = (uint64_t)(uintptr_t)(uring.bufs + (size_t)bid * URING_BUF_BYTES);
+    b->len = URING_BUF_BYTES;
+    b->bid = (uint16_t)bid;
+    __atomic_store_n(&uring.br->tail, ++uring.br_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_queue_send(HttpConn *c) {
+    if (c->queued) return;
+    c->queued = 1;
+    c->send_next = uring.send_queue;
+    uring.send_queue = c;
+}
+
+/* Take the connection down: shutting the socket ends its recv and any send,
+   and it is freed once their completions are in.
+*/
+static void uring_kill(HttpConn *c) {
+    if (!c->dead) {
+        c->dead = 1;
+        shutdown(c->fd, SHUT_RDWR);
+        http.syscalls++;
     }
-    return NULL;
+    if (!c->ops && !c->queued) http_close(c);
 }
 
-// find node by long url (traverse long_table via next_long) 
-Node *find_by_long(const char *long_url) {
-    unsigned long h = hash_str(long_url);
-    Node *cur = long_table[h];
-    while (cur) {
-        if (strcmp(cur->long_url, long_url) == 0) return cur;
-        cur = cur->next_long;
+// Hand each queued connection's responses to a send, unless one is in flight
+static void uring_flush_sends() {
+    HttpConn *c;
+    while ((c = uring.send_queue)) {
+        uring.send_queue = c->send_next;
+        c->queued = 0;
+        if (c->dead) {
+            uring_kill(c);
+            continue;
+        }
+        if (c->sending || !c->out_len) continue;
+        char *b = c->wire;
+        size_t cap = c->wire_cap;
+        c->wire = c->out;
+        c->wire_cap = c->out_cap;
+        c->wire_len = c->out_len;
+        c->wire_pos = 0;
+        c->out = b;
+        c->out_cap = cap;
+        c->out_len = 0;
+        uring_send(c);
+        if (!c->recv_armed && !c->closing) {
+            c->throttled = 0;
+            uring_recv(c);
+        }
     }
-    return NULL;
 }
 
-// Insert a new node into both tables (node allocated once) 
-void insert_mapping(const char *short_code, const char *long_url) {
-    Node *node = malloc(sizeof(Node));
-    if (!node) {
+static void uring_on_recv(HttpConn *c, int res, unsigned flags) {
+    if (!(flags & IORING_CQE_F_MORE)) {
+        c->recv_armed = 0;
+        c->ops--;
+    }
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0 && !c->dead) http_feed(c, uring.bufs + (size_t)bid * URING_BUF_BYTES, (size_t)res);
+        uring_recycle(bid);
+    }
+    if (c->dead) {
+        uring_kill(c);
+        return;
+    }
+    if (res == 0) {
+        c->closing = 1; // the client is done sending
+    } else if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+        if (res == -EINVAL && uring.recv_multishot) {
+            uring.recv_multishot = 0; // kernel without multishot recv
+        } else {
+            uring_kill(c);
+            return;
+        }
+    }
+    if (c->out_len) uring_queue_send(c);
+    if (c->closing) {
+        if (!c->sending && !c->out_len) uring_kill(c);
+    } else if (c->out_len >= HTTP_OUT_MAX) {
+        if (c->recv_armed && !c->throttled) uring_throttle(c);
+    } else if (!c->recv_armed) {
+        c->throttled = 0;
+        uring_recv(c);
+    }
+}
+
+static void uring_on_send(HttpConn *c, int res) {
+    c->ops--;
+    c->sending = 0;
+    if (res < 0 || c->dead) {
+        uring_kill(c);
+        return;
+    }
+    c->wire_pos += (size_t)res;
+    if (c->wire_pos < c->wire_len) {
+        uring_send(c);
+        return;
+    }
+    c->wire_len = c->wire_pos = 0;
+    if (c->out_len) uring_queue_send(c);
+    else if (c->closing) uring_kill(c);
+}
+
+static void uring_on_accept(int res, unsigned flags) {
+    if (res >= 0) uring_recv(http_new_conn(res));
+    else if (res == -EINVAL && uring.accept_multishot) uring.accept_multishot = 0;
+    else if (res != -EINTR && res != -ECONNABORTED) fprintf(stderr, "accept: %s\n", strerror(-res));
+    if (!(flags & IORING_CQE_F_MORE)) uring_accept();
+}
+
+static void uring_reap() {
+    unsigned head = *uring.cq_head;
+    for (unsigned tail; head != (tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE));) {
+        for (; head != tail; ++head) {
+            struct io_uring_cqe *cqe = &uring.cqes[head & uring.cq_mask];
+            HttpConn *c = (HttpConn *)(uintptr_t)(cqe->user_data & ~(uint64_t)7);
+            switch (cqe->user_data & 7) {
+            case OP_ACCEPT: uring_on_accept(cqe->res, cqe->flags); break;
+            case OP_RECV: uring_on_recv(c, cqe->res, cqe->flags); break;
+            case OP_SEND: uring_on_send(c, cqe->res); break;
+            }
+        }
+        __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+static void uring_teardown() {
+    if (uring.fd >= 0) close(uring.fd);
+    if (uring.ring) munmap(uring.ring, uring.ring_bytes);
+    if (uring.sqes) munmap(uring.sqes, uring.sqe_bytes);
+    if (uring.br) munmap(uring.br, uring.br_bytes);
+    free(uring.bufs);
+    uring = (Uring){ .fd = -1 };
+}
+
+// Set up the rings and the receive buffers; returns 0, or an errno value
+static int uring_setup() {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_ENTRIES * 4; // multishot recv posts several completions per submission
+#ifdef IORING_SETUP_DEFER_TASKRUN
+    p.flags |= IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+#endif
+    uring.fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (uring.fd < 0 && errno == EINVAL) {
+        // older kernel: plain task work
+        p.flags = IORING_SETUP_CQSIZE;
+        uring.fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    }
+    if (uring.fd < 0) return errno;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        uring_teardown();
+        return ENOSYS;
+    }
+    size_t sq_bytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_bytes = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    uring.ring_bytes = sq_bytes > cq_bytes ? sq_bytes : cq_bytes;
+    uring.ring = mmap(NULL, uring.ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd,
+                      IORING_OFF_SQ_RING);
+    uring.sqe_bytes = p.sq_entries * sizeof(struct io_uring_sqe);
+    uring.sqes = mmap(NULL, uring.sqe_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd,
+                      IORING_OFF_SQES);
+    uring.br_bytes = URING_BUFS * sizeof(struct io_uring_buf);
+    uring.br = mmap(NULL, uring.br_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (uring.ring == MAP_FAILED || uring.sqes == MAP_FAILED || uring.br == MAP_FAILED) {
+        int err = errno;
+        if (uring.ring == MAP_FAILED) uring.ring = NULL;
+        if (uring.sqes == MAP_FAILED) uring.sqes = NULL;
+        if (uring.br == MAP_FAILED) uring.br = NULL;
+        uring_teardown();
+        return err;
+    }
+    char *r = uring.ring;
+    uring.sq_head = (unsigned *)(r + p.sq_off.head);
+    uring.sq_tail = (unsigned *)(r + p.sq_off.tail);
+    uring.sq_array = (unsigned *)(r + p.sq_off.array);
+    uring.sq_mask = *(unsigned *)(r + p.sq_off.ring_mask);
+    uring.sq_entries = p.sq_entries;
+    uring.sq_local = *uring.sq_tail;
+    uring.cq_head = (unsigned *)(r + p.cq_off.head);
+    uring.cq_tail = (unsigned *)(r + p.cq_off.tail);
+    uring.cq_mask = *(unsigned *)(r + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(r + p.cq_off.cqes);
+
+    uring.bufs = malloc((size_t)URING_BUFS * URING_BUF_BYTES);
+    if (!uring.bufs) {
         fprintf(stderr, "Out of memory\n");
         exit(1);
     }
-    strcpy(node->short_code, short_code);
-    node->long_url = strdup(long_url);
-    node->next_short = NULL;
-    node->next_long = NULL;
-
-    // insert into short_table (head insertion) 
-    unsigned long hs = hash_str(short_code);
-    node->next_short = short_table[hs];
-    short_table[hs] = node;
-
-    // insert into long_table (head insertion) 
-    unsigned long hl = hash_str(long_url);
-    node->next_long = long_table[hl];
-    long_table[hl] = node;
-}
-
-// Unlink node from short_table chain given exact node pointer 
-int unlink_from_short_table(Node *node) {
-    if (!node) return 0;
-    unsigned long hs = hash_str(node->short_code);
-    Node *cur = short_table[hs];
-    Node *prev = NULL;
-    while (cur) {
-        if (cur == node) {
-            if (prev) prev->next_short = cur->next_short;
-            else short_table[hs] = cur->next_short;
-            return 1;
+    struct io_uring_buf_reg reg = { .ring_addr = (uint64_t)(uintptr_t)uring.br, .ring_entries = URING_BUFS,
+                                    .bgid = URING_BGID };
+    if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        int err = errno;
+        uring_teardown();
+        return err;
+    }
+    for (unsigned i = 0; i < URING_BUFS; ++i) uring_recycle(i);
+    uring.recv_multishot = 1;
+    uring.accept_multishot = 1;
+    return 0;
+}
+
+// Returns 0 when io_uring cannot be used here
+static int serve_uring() {
+    int err = uring_setup();
+    if (err) {
+        fprintf(stderr, "io_uring unavailable (%s); using epoll\n", strerror(err));
+        return 0;
+    }
+    // blocking accept: io_uring waits for connections itself
+    fcntl(http.listen_fd, F_SETFL, fcntl(http.listen_fd, F_GETFL) & ~O_NONBLOCK);
+    uring_accept();
+    int timeout = 0;
+    while (!__atomic_load_n(&serve_stop, __ATOMIC_RELAXED)) {
+        uring_flush_sends();
+        if (uring_enter(timeout != 0, timeout) < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+            perror("io_uring_enter");
+            break;
+        }
+        uring_reap();
+        timeout = serve_idle();
+    }
+    // let the kernel finish with every connection before freeing them
+    for (HttpConn *c = http.conns, *next; c; c = next) {
+        next = c->next;
+        uring_kill(c);
+    }
+    for (int tries = 0; http.conns && tries < 100; ++tries) {
+        uring_flush_sends();
+        uring_enter(1, 10);
+        uring_reap();
+    }
+    uring_teardown();
+    while (http.conns) http_close(http.conns);
+    return 1;
+}
+#else
+static int serve_uring() {
+    fprintf(stderr, "io_uring unavailable (built without its headers); using epoll\n");
+    return 0;
+}
+#endif
+
+static const char *backend_names[] = { "epoll", "io_uring" };
+
+/* Open one SO_REUSEPORT listener per server thread on addr ("[ADDR:]PORT")
+   into fds; returns 0, or -1. Port 0 picks a free one, returned in *port.
+*/
+static int serve_listen(const char *addr, int *port, int *fds) {
+    struct sockaddr_in sa = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_ANY) };
+    const char *colon = strrchr(addr, ':');
+    const char *ps = colon ? colon + 1 : addr;
+    if (colon) {
+        char host[64];
+        size_t n = (size_t)(colon - addr);
+        if (n >= sizeof(host)) n = sizeof(host) - 1;
+        memcpy(host, addr, n);
+        host[n] = '\0';
+        if (inet_pton(AF_INET, host, &sa.sin_addr) != 1) {
+            fprintf(stderr, "Invalid address: %s\n", host);
+            return -1;
         }
-        prev = cur;
-        cur = cur->next_short;
     }
+    char *end;
+    long p = strtol(ps, &end, 10);
+    if (*end != '\0' || p < 0 || p > 65535) {
+        fprintf(stderr, "Invalid port: %s\n", ps);
+        return -1;
+    }
+    sa.sin_port = htons((uint16_t)p);
+    for (int i = 0; i < serve_threads; ++i) {
+        // the first bind settles the port the others join; a lone listener keeps it to itself
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1;
+        socklen_t len = sizeof(sa);
+        if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+            (serve_threads > 1 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) ||
+            bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(fd, SOMAXCONN) != 0 ||
+            getsockname(fd, (struct sockaddr *)&sa, &len) != 0) {
+            perror(addr);
+            if (fd >= 0) close(fd);
+            while (i) close(fds[--i]);
+            return -1;
+        }
+        fds[i] = fd;
+    }
+    *port = ntohs(sa.sin_port);
     return 0;
 }
 
-// Unlink node from long_table chain given exact node pointer 
-int unlink_from_long_table(Node *node) {
-    if (!node) return 0;
-    unsigned long hl = hash_str(node->long_url);
-    Node *cur = long_table[hl];
-    Node *prev = NULL;
-    while (cur) {
-        if (cur == node) {
-            if (prev) prev->next_long = cur->next_long;
-            else long_table[hl] = cur->next_long;
-            return 1;
+static int serve_loop(int backend) {
+    if (backend == BACKEND_URING && serve_uring()) return BACKEND_URING;
+    serve_epoll();
+    return BACKEND_EPOLL;
+}
+
+typedef struct ServeWorker {
+    pthread_t thread;
+    int id;
+    int backend;        // asked for, then used
+    HttpServer http;    // the thread's settings in, its counters out
+} ServeWorker;
+
+static void *serve_worker(void *arg) {
+    ServeWorker *w = arg;
+    serve_id = w->id;
+    http = w->http;
+    w->backend = serve_loop(w->backend);
+    w->http = http;
+    return NULL;
+}
+
+/* Serve on the listeners in fds, one thread each, until SIGINT or SIGTERM,
+   then close them; the counters of every thread end up in http. Returns the
+   backend used.
+*/
+static int serve_run(int backend, const int *fds) {
+    struct sigaction act = { .sa_handler = serve_on_signal };
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    http.redirect = http.status == 301 ? "HTTP/1.1 301 Moved Permanently\r\nLocation: "
+                                       : "HTTP/1.1 302 Found\r\nLocation: ";
+    ServeWorker workers[SERVE_MAX_THREADS];
+    // the signals are left to this thread; the others see serve_stop within SERVE_IDLE_MS
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    for (int i = 1; i < serve_threads; ++i) {
+        workers[i] = (ServeWorker){ .id = i, .backend = backend, .http = http };
+        workers[i].http.listen_fd = fds[i];
+        if (pthread_create(&workers[i].thread, NULL, serve_worker, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
         }
-        prev = cur;
-        cur = cur->next_long;
     }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    http.listen_fd = fds[0];
+    int used = serve_loop(backend);
+    close(fds[0]);
+    for (int i = 1; i < serve_threads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        close(fds[i]);
+        http.requests += workers[i].http.requests;
+        http.redirects += workers[i].http.redirects;
+        http.shortened += workers[i].http.shortened;
+        http.connections += workers[i].http.connections;
+        http.syscalls += workers[i].http.syscalls;
+    }
+    http.listen_fd = -1;
+    return used;
+}
+
+/* Serve redirects on addr ("[ADDR:]PORT") until SIGINT or SIGTERM. Returns 1
+   if the server could not start.
+*/
+static int serve(const char *addr) {
+    int port, fds[SERVE_MAX_THREADS];
+    if (serve_listen(addr, &port, fds) != 0) return 1;
+    printf("Serving redirects on port %d with %d thread%s\n", port, serve_threads, serve_threads == 1 ? "" : "s");
+    fflush(stdout);
+    int used = serve_run(http.backend, fds);
+    printf("Served %llu requests (%llu redirects, %llu shortened) on %llu connections with %s, %.2f syscalls per request\n",
+           (unsigned long long)http.requests, (unsigned long long)http.redirects,
+           (unsigned long long)http.shortened, (unsigned long long)http.connections, backend_names[used],
+           http.requests ? (double)http.syscalls / http.requests : 0.0);
     return 0;
 }
 
-// Remove mapping by short_code: unlink from both tables and free node 
-int remove_by_short(const char *short_code) {
-    Node *node = find_by_short(short_code);
-    if (!node) return 0;
+/* Built-in load test (--loadtest SECONDS): for each backend and pipeline
+   depth, fork a server on a loopback port and drive it from LOADTEST_CONNS
+   client connections for SECONDS, counting responses. The server child
+   reports how many requests it answered and syscalls it made. Without any
+   mappings loaded, LOADTEST_URLS synthetic ones are generated first.
+*/
+#define LOADTEST_CONNS 256
+#define LOADTEST_URLS 100000
+#define LOADTEST_CODES 4096
 
-    // unlink from both hash tables 
-    unlink_from_short_table(node);
-    unlink_from_long_table(node);
+typedef struct LoadResult {
+    uint64_t requests;
+    uint64_t syscalls;
+    int backend;
+} LoadResult;
 
-    // free payload and node 
-    free(node->long_url);
-    free(node);
-    return 1;
+// Drive the server on port; returns the number of responses received
+static uint64_t loadtest_client(int port, const char (*codes)[SHORTENER_CODE_LEN + 1], size_t ncodes,
+                                int depth, double secs) {
+    struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons((uint16_t)port),
+                              .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    int fds[LOADTEST_CONNS];
+    int pending[LOADTEST_CONNS], matched[LOADTEST_CONNS];
+    char *reqs[LOADTEST_CONNS];
+    size_t req_len[LOADTEST_CONNS];
+    uint64_t responses = 0;
+    for (int i = 0; i < LOADTEST_CONNS; ++i) {
+        reqs[i] = malloc((size_t)depth * 64);
+        if (!reqs[i]) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        req_len[i] = 0;
+        for (int d = 0; d < depth; ++d)
+            req_len[i] += (size_t)sprintf(reqs[i] + req_len[i], "GET /%s HTTP/1.1\r\nHost: lt\r\n\r\n",
+                                          codes[((size_t)i * depth + d) % ncodes]);
+        fds[i] = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fds[i] < 0 || connect(fds[i], (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+            perror("loadtest connect");
+            exit(1);
+        }
+        int one = 1;
+        setsockopt(fds[i], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(fds[i], F_SETFL, O_NONBLOCK);
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t)i };
+        epoll_ctl(ep, EPOLL_CTL_ADD, fds[i], &ev);
+        pending[i] = matched[i] = 0;
+    }
+    double t0 = now_sec(), t = t0;
+    for (int i = 0; i < LOADTEST_CONNS; ++i) {
+        if (write(fds[i], reqs[i], req_len[i]) == (ssize_t)req_len[i]) pending[i] = depth;
+    }
+    char buf[64 * 1024];
+    struct epoll_event events[64];
+    while ((t = now_sec()) - t0 < secs) {
+        int n = epoll_wait(ep, events, 64, 100);
+        for (int k = 0; k < n; ++k) {
+            int i = (int)events[k].data.u32;
+            ssize_t r;
+            while ((r = read(fds[i], buf, sizeof(buf))) > 0) {
+                // responses have no body: each ends at the first blank line
+                for (ssize_t j = 0; j < r; ++j) {
+                    char ch = buf[j];
+                    int m = matched[i];
+                    m = (ch == (m & 1 ? '\n' : '\r')) ? m + 1 : ch == '\r';
+                    if (m == 4) {
+                        m = 0;
+                        responses++;
+                        pending[i]--;
+                    }
+                    matched[i] = m;
+                }
+            }
+            if (pending[i] == 0 && write(fds[i], reqs[i], req_len[i]) == (ssize_t)req_len[i]) pending[i] = depth;
+        }
+    }
+    for (int i = 0; i < LOADTEST_CONNS; ++i) {
+        close(fds[i]);
+        free(reqs[i]);
+    }
+    close(ep);
+    return responses;
 }
 
-// Remove mapping by long_url: unlink from both tables and free node 
-int remove_by_long(const char *long_url) {
-    Node *node = find_by_long(long_url);
-    if (!node) return 0;
+typedef struct LoadCodes {
+    char codes[LOADTEST_CODES][SHORTENER_CODE_LEN + 1];
+    size_t n;
+} LoadCodes;
 
-    unlink_from_short_table(node);
-    unlink_from_long_table(node);
+static int loadtest_collect(void *arg, const char *code, const char *url, size_t len) {
+    LoadCodes *lc = arg;
+    (void)url;
+    (void)len;
+    memcpy(lc->codes[lc->n++], code, SHORTENER_CODE_LEN + 1);
+    return lc->n == LOADTEST_CODES;
+}
 
-    free(node->long_url);
-    free(node);
-    return 1;
+static void run_loadtest(double secs) {
+    if (!shortener_count(store)) {
+        char url[64], code[SHORTENER_CODE_LEN];
+        for (size_t i = 0; i < LOADTEST_URLS; ++i) {
+            int n = snprintf(url, sizeof(url), "https://loadtest.example.com/item/%zu", i);
+            shortener_gen(store, url, (size_t)n, code);
+        }
+    }
+    // finish any warm-up and resizing first, so the runs measure lookups alone
+    while (shortener_idle(store)) {}
+    static LoadCodes lc;
+    shortener_foreach(store, loadtest_collect, &lc);
+    if (!lc.n) return;
+    printf("Load test: %d connections, %d server thread%s, %.1fs per run, %zu mappings\n", LOADTEST_CONNS,
+           serve_threads, serve_threads == 1 ? "" : "s", secs, shortener_count(store));
+    static const int depths[] = { 1, 16 };
+    for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); ++d) {
+        for (int backend = BACKEND_EPOLL; backend <= BACKEND_URING; ++backend) {
+            int port, fds[2], lfds[SERVE_MAX_THREADS];
+            if (serve_listen("127.0.0.1:0", &port, lfds) != 0) return;
+            if (pipe(fds) != 0) {
+                for (int i = 0; i < serve_threads; ++i) close(lfds[i]);
+                return;
+            }
+            fflush(NULL);
+            pid_t pid = fork();
+            if (pid == 0) {
+                // server: no log writes from the child
+                close(fds[0]);
+                shortener_detach_log(store);
+                LoadResult res = { 0, 0, 0 };
+                res.backend = serve_run(backend, lfds);
+                res.requests = http.requests;
+                res.syscalls = http.syscalls;
+                _exit(write(fds[1], &res, sizeof(res)) == sizeof(res) ? 0 : 1);
+            }
+            close(fds[1]);
+            for (int i = 0; i < serve_threads; ++i) close(lfds[i]);
+            if (pid < 0) {
+                perror("fork");
+                close(fds[0]);
+                return;
+            }
+            uint64_t responses = loadtest_client(port, lc.codes, lc.n, depths[d], secs);
+            kill(pid, SIGTERM);
+            LoadResult res;
+            ssize_t got = read(fds[0], &res, sizeof(res));
+            close(fds[0]);
+            waitpid(pid, NULL, 0);
+            if (got != sizeof(res)) {
+                printf("%-8s pipeline %2d: server failed\n", backend_names[backend], depths[d]);
+                continue;
+            }
+            printf("%-8s pipeline %2d: %10.0f requests/s, %.3f server syscalls per request\n",
+                   backend_names[res.backend], depths[d], responses / secs,
+                   res.requests ? (double)res.syscalls / res.requests : 0.0);
+        }
+    }
 }
 
-// Generate short URL. If long URL already present, return existing short code. 
-void generate_short_url(const char *long_url, char *out_short_code) {
-    Node *existing = find_by_long(long_url);
-    if (existing) {
-        strcpy(out_short_code, existing->short_code);
-        return;
+/* Insert n synthetic URLs, then look up n random codes among them. The codes
+   gen hands back are kept in one array (SHORTENER_CODE_LEN bytes each), since
+   the library does not expose how it derives them.
+*/
+static int bench_train = 0; // --train: train the symbol table before reading URLs back
+
+static void run_benchmark(size_t n) {
+    char url[64];
+    char *codes = malloc(n * SHORTENER_CODE_LEN);
+    if (!codes) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    double t0 = now_sec();
+    for (size_t i = 0; i < n; ++i) {
+        int len = snprintf(url, sizeof(url), "https://bench.example.com/item/%zu", i);
+        shortener_gen(store, url, (size_t)len, codes + i * SHORTENER_CODE_LEN);
+    }
+    double t1 = now_sec();
+    uint64_t x = 88172645463325252ULL;
+    size_t hits = 0;
+    for (size_t i = 0; i < n; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        // a zero capacity finds the mapping without copying its URL out
+        if (shortener_get(store, codes + x % n * SHORTENER_CODE_LEN, SHORTENER_CODE_LEN, url, 0) >= 0) hits++;
     }
+    double t2 = now_sec();
+    unsigned trained = bench_train ? shortener_train(store) : 0;
+    double t3 = now_sec();
+    char longurl[SHORTENER_URL_MAX];
+    size_t bytes = 0;
+    for (size_t i = 0; i < n; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        long len = shortener_get(store, codes + x % n * SHORTENER_CODE_LEN, SHORTENER_CODE_LEN, longurl,
+                                 sizeof(longurl));
+        if (len >= 0) bytes += (size_t)len;
+    }
+    double t4 = now_sec();
+    free(codes);
+    printf("gen: %zu urls in %.2fs (%.0f ns/op)\n", n, t1 - t0, (t1 - t0) * 1e9 / n);
+    printf("get: %zu/%zu hits in %.2fs (%.0f ns/op)\n", hits, n, t2 - t1, (t2 - t1) * 1e9 / n);
+    if (bench_train) printf("train: %u symbols in %.2fs\n", trained, t3 - t2);
+    printf("url: %zu retrieved bytes in %.2fs (%.0f ns/op)\n", bytes, t4 - t3, (t4 - t3) * 1e9 / n);
+    shortener_print_stats(store);
+}
 
-    for (;;) {
-        char candidate[SHORT_CODE_LEN + 1];
-        uint64_t seq = global_id % MODULUS;
-        uint64_t scrambled = scramble_id(seq);
-        id_to_base62(scrambled, candidate);
-
-        if (!find_by_short(candidate)) {
-            insert_mapping(candidate, long_url);
-            strcpy(out_short_code, candidate);
-            global_id++;
-            return;
+/* --bench-mt N: n synthetic mappings, then rounds of 1, 2, 4, ... reader
+   threads (up to --threads, else the online CPUs) looking up random codes for
+   BENCH_MT_SECS each while one writer thread keeps generating and deleting
+   URLs of its own. Lookups take no lock, so reader throughput should grow
+   with the threads even though every write takes shard locks. Then rounds of
+   1, 2, 4, ... writer threads alone, which scale as far as --shards lets them
+   stay out of each other's way.
+*/
+#define BENCH_MT_SECS 1.0
+
+typedef struct BenchReader {
+    pthread_t thread;
+    uint64_t seed;
+    uint64_t gets;
+    uint64_t hits;
+} __attribute__((aligned(64))) BenchReader;
+
+static const char *bench_codes;     // the mappings readers look up
+static size_t bench_codes_n;
+static int bench_stop;
+
+static void *bench_reader(void *arg) {
+    BenchReader *r = arg;
+    char url[SHORTENER_URL_MAX];
+    uint64_t x = r->seed;
+    while (!__atomic_load_n(&bench_stop, __ATOMIC_RELAXED)) {
+        // a batch between checks of the stop flag
+        for (int i = 0; i < 256; ++i) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            if (shortener_get(store, bench_codes + x % bench_codes_n * SHORTENER_CODE_LEN, SHORTENER_CODE_LEN, url,
+                              sizeof(url)) >= 0)
+                r->hits++;
         }
-        global_id++;
+        r->gets += 256;
     }
+    return NULL;
 }
 
-// Retrieve original long URL given short code. Returns 1 if found. 
-int retrieve_original(const char *short_code, char *out_long_url, size_t out_size) {
-    Node *n = find_by_short(short_code);
-    if (!n) return 0;
-    strncpy(out_long_url, n->long_url, out_size - 1);
-    out_long_url[out_size - 1] = '\0';
-    return 1;
+typedef struct BenchWriter {
+    pthread_t thread;
+    int id;
+    uint64_t ops;
+} __attribute__((aligned(64))) BenchWriter;
+
+static void *bench_writer(void *arg) {
+    BenchWriter *w = arg;
+    char url[64], code[SHORTENER_CODE_LEN];
+    for (size_t i = 0; !__atomic_load_n(&bench_stop, __ATOMIC_RELAXED); ++i) {
+        int len = snprintf(url, sizeof(url), "https://bench.example.com/churn/%d/%zu", w->id, i);
+        if (shortener_gen(store, url, (size_t)len, code) > 0) shortener_del(store, code, SHORTENER_CODE_LEN);
+        w->ops += 2;
+    }
+    return NULL;
 }
 
-// Delete mapping given short code. Returns 1 on success. 
-int delete_short(const char *short_code) {
-    return remove_by_short(short_code);
+static void bench_mt_sleep() {
+    struct timespec ts = { (time_t)BENCH_MT_SECS, (long)((BENCH_MT_SECS - (time_t)BENCH_MT_SECS) * 1e9) };
+    nanosleep(&ts, NULL);
 }
 
-// Print all mappings by traversing short_table (each node freed/owned once in short_table). 
-void print_all_mappings() {
-    printf("Current mappings (short -> long):\n");
-    for (int i = 0; i < HASH_SIZE; ++i) {
-        Node *cur = short_table[i];
-        while (cur) {
-            printf("%s -> %s\n", cur->short_code, cur->long_url);
-            cur = cur->next_short;
+static void run_mt_benchmark(size_t n, int max_readers) {
+    char url[64];
+    char *codes = malloc(n * SHORTENER_CODE_LEN);
+    BenchReader *readers = calloc((size_t)max_readers, sizeof(BenchReader));
+    BenchWriter *writers = calloc((size_t)max_readers, sizeof(BenchWriter));
+    if (!codes || !readers || !writers) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        int len = snprintf(url, sizeof(url), "https://bench.example.com/item/%zu", i);
+        shortener_gen(store, url, (size_t)len, codes + i * SHORTENER_CODE_LEN);
+    }
+    bench_codes = codes;
+    bench_codes_n = n;
+    printf("%zu mappings, one writer running gen+del, %.1fs per round\n", n, BENCH_MT_SECS);
+    double base = 0;
+    for (int k = 1;; k = k * 2 < max_readers ? k * 2 : max_readers) {
+        __atomic_store_n(&bench_stop, 0, __ATOMIC_RELAXED);
+        for (int i = 0; i < k; ++i) {
+            readers[i] = (BenchReader){ .seed = 88172645463325252ULL + 0x9e3779b97f4a7c15ULL * (uint64_t)i };
+            if (pthread_create(&readers[i].thread, NULL, bench_reader, &readers[i]) != 0) {
+                perror("pthread_create");
+                exit(1);
+            }
+        }
+        writers[0] = (BenchWriter){ .id = 0 };
+        if (pthread_create(&writers[0].thread, NULL, bench_writer, &writers[0]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        double t0 = now_sec();
+        bench_mt_sleep();
+        __atomic_store_n(&bench_stop, 1, __ATOMIC_RELAXED);
+        uint64_t gets = 0, hits = 0;
+        for (int i = 0; i < k; ++i) {
+            pthread_join(readers[i].thread, NULL);
+            gets += readers[i].gets;
+            hits += readers[i].hits;
+        }
+        pthread_join(writers[0].thread, NULL);
+        double secs = now_sec() - t0;
+        double rate = gets / secs;
+        if (k == 1) base = rate;
+        printf("%2d reader%s %12.0f gets/s (%10.0f per thread, %.2fx), %llu/%llu hits, writer %.0f ops/s\n", k,
+               k == 1 ? ": " : "s:", rate, rate / k, rate / base, (unsigned long long)hits, (unsigned long long)gets,
+               writers[0].ops / secs);
+        if (k == max_readers) break;
+    }
+    printf("writers alone, each running gen+del on URLs of its own\n");
+    for (int k = 1;; k = k * 2 < max_readers ? k * 2 : max_readers) {
+        __atomic_store_n(&bench_stop, 0, __ATOMIC_RELAXED);
+        for (int i = 0; i < k; ++i) {
+            writers[i] = (BenchWriter){ .id = i };
+            if (pthread_create(&writers[i].thread, NULL, bench_writer, &writers[i]) != 0) {
+                perror("pthread_create");
+                exit(1);
+            }
+        }
+        double t0 = now_sec();
+        bench_mt_sleep();
+        __atomic_store_n(&bench_stop, 1, __ATOMIC_RELAXED);
+        uint64_t ops = 0;
+        for (int i = 0; i < k; ++i) {
+            pthread_join(writers[i].thread, NULL);
+            ops += writers[i].ops;
         }
+        double secs = now_sec() - t0;
+        double rate = ops / secs;
+        if (k == 1) base = rate;
+        printf("%2d writer%s %12.0f ops/s (%10.0f per thread, %.2fx)\n", k, k == 1 ? ": " : "s:", rate, rate / k,
+               rate / base);
+        if (k == max_readers) break;
     }
+    free(writers);
+    free(readers);
+    free(codes);
+    shortener_print_stats(store);
+}
+
+static volatile uint64_t bench_sink; // keeps hash results observable
+
+static uint64_t bench_djb2(const char *s) {
+    return shortener_hash_djb2(s, strlen(s));
 }
 
-/* Clean-up: iterate short_table and free all nodes once.
-   After freeing through short_table, clear long_table buckets.
+static uint64_t bench_wyhash(const char *s) {
+    return shortener_hash(s, strlen(s));
+}
+
+/* Compare djb2 against the seeded word-at-a-time hash on a URL corpus (one URL
+   per line): hashing speed, and how evenly each spreads the corpus over the
+   smallest power-of-two table with a bucket per URL. The share of empty buckets
+   is compared with what a uniformly random hash would leave, (1 - 1/buckets)^n.
 */
-void cleanup_all() {
-    for (int i = 0; i < HASH_SIZE; ++i) {
-        Node *s = short_table[i];
-        while (s) {
-            Node *t = s->next_short;
-            free(s->long_url);
-            free(s);
-            s = t;
+static void run_hash_benchmark(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return;
+    }
+    char line[SHORTENER_URL_MAX];
+    char **urls = NULL;
+    size_t n = 0, cap = 0, bytes = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == '\0') continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            urls = realloc(urls, cap * sizeof(char *));
+            if (!urls) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
         }
-        short_table[i] = NULL;
+        urls[n++] = strdup(line);
+        bytes += strlen(line);
     }
-    //long_table still holds dangling pointers now; clear them to NULL 
-    for (int i = 0; i < HASH_SIZE; ++i) {
-        long_table[i] = NULL;
+    fclose(f);
+    if (n == 0) {
+        printf("No URLs in %s\n", path);
+        free(urls);
+        return;
     }
-    printf("Clean-Up Done!!\nExiting Code...\n");
+
+    size_t buckets = 1;
+    while (buckets < n) buckets <<= 1;
+    uint32_t *chain = malloc(buckets * sizeof(uint32_t));
+    if (!chain) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    double ideal = 1.0, base = 1.0 - 1.0 / buckets;
+    for (size_t e = n; e; e >>= 1, base *= base)
+        if (e & 1) ideal *= base;
+    printf("%zu URLs, %.1f bytes average, %zu buckets (uniform hash: %.1f%% empty)\n",
+           n, (double)bytes / n, buckets, 100.0 * ideal);
+
+    struct { const char *name; uint64_t (*fn)(const char *); } hashes[] = {
+        { "djb2", bench_djb2 },
+        { "wyhash", bench_wyhash },
+    };
+    for (size_t h = 0; h < sizeof(hashes) / sizeof(hashes[0]); ++h) {
+        uint64_t sink = 0;
+        size_t rounds = 0;
+        double t0 = now_sec(), t1;
+        do {
+            for (size_t i = 0; i < n; ++i) sink ^= hashes[h].fn(urls[i]);
+            rounds++;
+            t1 = now_sec();
+        } while (t1 - t0 < 0.5);
+        bench_sink = sink;
+
+        memset(chain, 0, buckets * sizeof(uint32_t));
+        for (size_t i = 0; i < n; ++i) chain[hashes[h].fn(urls[i]) & (buckets - 1)]++;
+        size_t empty = 0;
+        uint32_t longest = 0;
+        for (size_t i = 0; i < buckets; ++i) {
+            if (chain[i] == 0) empty++;
+            if (chain[i] > longest) longest = chain[i];
+        }
+        double secs = (t1 - t0) / rounds;
+        printf("%-7s %6.1f ns/url %8.1f MB/s   longest chain %u, %.1f%% buckets empty\n",
+               hashes[h].name, secs * 1e9 / n, bytes / secs / 1e6, longest, 100.0 * empty / buckets);
+    }
+    free(chain);
+    for (size_t i = 0; i < n; ++i) free(urls[i]);
+    free(urls);
 }
 
-// Count non-empty buckets in both tables (keeps previous behavior) 
-void count() {
-    int short_count = 0, long_count = 0;
-    for (int i = 0; i < HASH_SIZE; i++) {
-        if (short_table[i]) short_count++;
-        if (long_table[i]) long_count++;
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--capacity N] [--rehash-step N] [--host-dict] [--snapshot PATH] [--wal PATH [--fsync always|group:MS|os]] [--serve [ADDR:]PORT [--redirect 301|302] [--backend uring|epoll] [--threads N]] [--shards N] [--loadtest SECONDS] [--bench N [--train]] [--bench-mt N] [--bench-hash FILE]\n", prog);
+}
+
+static int print_mapping(void *arg, const char *code, const char *url, size_t len) {
+    (void)arg;
+    printf("%s -> %.*s\n", code, (int)len, url);
+    return 0;
+}
+
+/* genbatch FILE: shorten every URL in a file (one per line) with one batch
+   call and report URLs per second. Lines too long to be a URL are skipped.
+*/
+static void run_genbatch(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return;
     }
-    printf("Short_table count->%d\nLong_table count->%d\n", short_count, long_count);
+    char line[SHORTENER_URL_MAX + 1];
+    char *text = NULL;
+    size_t *offs = NULL, *lens = NULL;
+    size_t n = 0, cap = 0, bytes = 0, text_cap = 0, skipped = 0;
+    while (fgets(line, sizeof(line), f)) {
+        size_t len = strcspn(line, "\r\n");
+        if (!line[len] && !feof(f)) {
+            // no newline within a URL's length: skip the rest of the line
+            int c;
+            while ((c = fgetc(f)) != EOF && c != '\n') {}
+            skipped++;
+            continue;
+        }
+        if (len == 0) continue;
+        if (len >= SHORTENER_URL_MAX) {
+            skipped++;
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            offs = realloc(offs, cap * sizeof(size_t));
+            lens = realloc(lens, cap * sizeof(size_t));
+        }
+        if (bytes + len > text_cap) {
+            text_cap = text_cap ? text_cap * 2 : 64 * 1024;
+            while (bytes + len > text_cap) text_cap *= 2;
+            text = realloc(text, text_cap);
+        }
+        if (!offs || !lens || !text) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        memcpy(text + bytes, line, len);
+        offs[n] = bytes;
+        lens[n++] = len;
+        bytes += len;
+    }
+    fclose(f);
+    // the text may have moved while it grew, so the pointers come last
+    const char **urls = malloc((n ? n : 1) * sizeof(char *));
+    char *codes = malloc((n ? n : 1) * SHORTENER_CODE_LEN);
+    if (!urls || !codes) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < n; ++i) urls[i] = text + offs[i];
+    if (skipped) printf("Skipped %zu lines of %d characters or more.\n", skipped, SHORTENER_URL_MAX);
+    if (n == 0) {
+        printf("No URLs in %s\n", path);
+    } else {
+        size_t before = shortener_count(store);
+        double t0 = now_sec();
+        long r = shortener_gen_batch(store, urls, lens, n, codes);
+        double secs = now_sec() - t0;
+        if (r == SHORTENER_EFULL) {
+            printf("Error: short code space exhausted.\n");
+        } else if (r >= 0) {
+            if ((size_t)r < n) printf("Error: short code space exhausted after %ld URLs.\n", r);
+            printf("Shortened %ld URLs from %s in %.3fs (%.0f URLs/s), %zu of them new\n", r, path, secs,
+                   secs > 0 ? r / secs : 0.0, shortener_count(store) - before);
+        }
+    }
+    free(codes);
+    free(urls);
+    free(text);
+    free(offs);
+    free(lens);
 }
 
-int main() {
+int main(int argc, char *argv[]) {
     char cmd[16];
-    char buffer[LONG_URL_MAX];
-    char short_code[SHORT_CODE_LEN + 1];
+    char buffer[SHORTENER_URL_MAX];
+    char short_code[SHORTENER_CODE_LEN];
+    size_t bench_n = 0;
+    size_t bench_mt_n = 0;
+    int threads_given = 0;
+    int shards_given = 0;
+    const char *bench_hash_file = NULL;
+    const char *serve_addr = NULL;
+    double loadtest_secs = 0;
+    shortener_options_t opts;
+    shortener_options_init(&opts);
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--capacity") == 0 && i + 1 < argc) {
+            char *end;
+            unsigned long long cap = strtoull(argv[++i], &end, 10);
+            if (*end != '\0' || cap == 0) {
+                fprintf(stderr, "Invalid capacity: %s\n", argv[i]);
+                return 1;
+            }
+            opts.capacity = (size_t)cap;
+        } else if (strcmp(argv[i], "--rehash-step") == 0 && i + 1 < argc) {
+            char *end;
+            unsigned long long step = strtoull(argv[++i], &end, 10);
+            if (*end != '\0') {
+                fprintf(stderr, "Invalid rehash step: %s\n", argv[i]);
+                return 1;
+            }
+            opts.rehash_step = (size_t)step;
+        } else if (strcmp(argv[i], "--host-dict") == 0) {
+            opts.host_dict = 1;
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            opts.snapshot = argv[++i];
+        } else if (strcmp(argv[i], "--wal") == 0 && i + 1 < argc) {
+            opts.wal = argv[++i];
+        } else if (strcmp(argv[i], "--fsync") == 0 && i + 1 < argc) {
+            const char *p = argv[++i];
+            if (strcmp(p, "always") == 0) {
+                opts.fsync = SHORTENER_FSYNC_ALWAYS;
+            } else if (strcmp(p, "os") == 0) {
+                opts.fsync = SHORTENER_FSYNC_OS;
+            } else if (strncmp(p, "group", 5) == 0 && (p[5] == '\0' || p[5] == ':')) {
+                opts.fsync = SHORTENER_FSYNC_GROUP;
+                if (p[5] == ':') {
+                    char *end;
+                    opts.group_ms = strtol(p + 6, &end, 10);
+                    if (*end != '\0' || opts.group_ms <= 0) {
+                        fprintf(stderr, "Invalid group commit interval: %s\n", p);
+                        return 1;
+                    }
+                }
+            } else {
+                fprintf(stderr, "Invalid fsync policy: %s\n", p);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_addr = argv[++i];
+        } else if (strcmp(argv[i], "--redirect") == 0 && i + 1 < argc) {
+            http.status = atoi(argv[++i]);
+            if (http.status != 301 && http.status != 302) {
+                fprintf(stderr, "Invalid redirect status: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc) {
+            const char *b = argv[++i];
+            if (strcmp(b, "epoll") == 0) {
+                http.backend = BACKEND_EPOLL;
+            } else if (strcmp(b, "uring") == 0 || strcmp(b, "io_uring") == 0) {
+                http.backend = BACKEND_URING;
+            } else {
+                fprintf(stderr, "Invalid backend: %s\n", b);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            char *end;
+            long n = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || n < 1 || n > SERVE_MAX_THREADS) {
+                fprintf(stderr, "Invalid thread count: %s (1 to %d)\n", argv[i], SERVE_MAX_THREADS);
+                return 1;
+            }
+            serve_threads = (int)n;
+            threads_given = 1;
+        } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            char *end;
+            long n = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || n < 1 || n > 256) {
+                fprintf(stderr, "Invalid shard count: %s (1 to 256)\n", argv[i]);
+                return 1;
+            }
+            opts.shards = (unsigned)n;
+            shards_given = 1;
+        } else if (strcmp(argv[i], "--loadtest") == 0 && i + 1 < argc) {
+            char *end;
+            loadtest_secs = strtod(argv[++i], &end);
+            if (*end != '\0' || loadtest_secs <= 0) {
+                fprintf(stderr, "Invalid load test duration: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--train") == 0) {
+            bench_train = 1;
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            char *end;
+            bench_n = strtoull(argv[++i], &end, 10);
+            if (*end != '\0' || bench_n == 0) {
+                fprintf(stderr, "Invalid benchmark size: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--bench-mt") == 0 && i + 1 < argc) {
+            char *end;
+            bench_mt_n = strtoull(argv[++i], &end, 10);
+            if (*end != '\0' || bench_mt_n == 0) {
+                fprintf(stderr, "Invalid benchmark size: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--bench-hash") == 0 && i + 1 < argc) {
+            bench_hash_file = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (bench_hash_file) {
+        run_hash_benchmark(bench_hash_file);
+        return 0;
+    }
+
+    int bench_threads = serve_threads;
+    if (bench_mt_n && !threads_given) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        bench_threads = cpus < 1 ? 1 : cpus > SERVE_MAX_THREADS ? SERVE_MAX_THREADS : (int)cpus;
+    }
+    // writers on more threads need more shards to keep out of each other's way
+    if (!shards_given && bench_threads > 1) opts.shards = 4 * (unsigned)bench_threads;
+    store = shortener_create(&opts);
+    if (bench_n) {
+        run_benchmark(bench_n);
+        cleanup_all();
+        return 0;
+    }
+    if (bench_mt_n) {
+        run_mt_benchmark(bench_mt_n, bench_threads);
+        cleanup_all();
+        return 0;
+    }
+    if (loadtest_secs) {
+        run_loadtest(loadtest_secs);
+        cleanup_all();
+        return 0;
+    }
+    if (serve_addr) {
+        int r = serve(serve_addr);
+        cleanup_all();
+        return r;
+    }
 
     printf("URL Shortener CLI\n");
-    printf("Commands: gen <long_url>, get <short_code>, del <short_code>, list, count, exit\n");
+    printf("Commands: gen <long_url>, genbatch <file>, get <short_code>, del <short_code>, list, count, stats, train, save, bgsave, compact, exit\n");
 
     while (1) {
+        shortener_idle(store);
         printf("> ");
         if (!fgets(buffer, sizeof(buffer), stdin)) break;
         buffer[strcspn(buffer, "\n")] = 0;
@@ -271,24 +1658,40 @@ int main() {
                 printf("Usage: gen <long_url>\n");
                 continue;
             }
-            if (strlen(p) >= LONG_URL_MAX) {
-                printf("Error: URL is too long! Maximum allowed length is %d characters.\n", LONG_URL_MAX - 1);
+            int r = shortener_gen(store, p, strlen(p), short_code);
+            if (r == SHORTENER_EINVAL) {
+                printf("Error: URL is too long! Maximum allowed length is %d characters.\n", SHORTENER_URL_MAX - 1);
+                continue;
+            }
+            if (r == SHORTENER_EFULL) {
+                printf("Error: short code space exhausted.\n");
+                continue;
+            }
+            printf("Short code: %.*s\n", SHORTENER_CODE_LEN, short_code);
+            continue;
+        }
+
+        if (strcmp(cmd, "genbatch") == 0) {
+            char *p = buffer + 8;
+            while (*p == ' ') p++;
+            if (*p == '\0') {
+                printf("Usage: genbatch <file>\n");
                 continue;
             }
-            generate_short_url(p, short_code);
-            printf("Short code: %s\n", short_code);
+            run_genbatch(p);
             continue;
         }
 
         if (strcmp(cmd, "get") == 0) {
-            char sc[SHORT_CODE_LEN + 1];
+            char sc[SHORTENER_CODE_LEN + 1];
             if (sscanf(buffer + 3, "%7s", sc) != 1) {
                 printf("Usage: get <short_code>\n");
                 continue;
             }
-            char longurl[LONG_URL_MAX];
-            if (retrieve_original(sc, longurl, sizeof(longurl))) {
-                printf("Original URL: %s\n", longurl);
+            char longurl[SHORTENER_URL_MAX];
+            long len = shortener_get(store, sc, strlen(sc), longurl, sizeof(longurl));
+            if (len >= 0) {
+                printf("Original URL: %.*s\n", (int)len, longurl);
             } else {
                 printf("Not found.\n");
             }
@@ -296,23 +1699,65 @@ int main() {
         }
 
         if (strcmp(cmd, "del") == 0) {
-            char sc[SHORT_CODE_LEN + 1];
+            char sc[SHORTENER_CODE_LEN + 1];
             if (sscanf(buffer + 3, "%7s", sc) != 1) {
                 printf("Usage: del <short_code>\n");
                 continue;
             }
-            if (delete_short(sc)) printf("Deleted mapping %s\n", sc);
+            if (shortener_del(store, sc, strlen(sc))) printf("Deleted mapping %s\n", sc);
             else printf("Not found.\n");
             continue;
         }
 
         if (strcmp(cmd, "list") == 0) {
-            print_all_mappings();
+            printf("Current mappings (short -> long):\n");
+            shortener_foreach(store, print_mapping, NULL);
             continue;
         }
 
         if (strcmp(cmd, "count") == 0) {
-            count();
+            shortener_print_buckets(store);
+            continue;
+        }
+
+        if (strcmp(cmd, "stats") == 0) {
+            shortener_print_stats(store);
+            continue;
+        }
+
+        if (strcmp(cmd, "save") == 0) {
+            double t0 = now_sec();
+            long n = shortener_save(store);
+            if (n == SHORTENER_ENOFILE) printf("Start with --snapshot PATH to save snapshots.\n");
+            else if (n == SHORTENER_EBUSY) printf("A background save is running.\n");
+            else if (n >= 0) printf("Saved %ld mappings to %s in %.2fs\n", n, opts.snapshot, now_sec() - t0);
+            continue;
+        }
+
+        if (strcmp(cmd, "bgsave") == 0) {
+            long pid = shortener_bgsave(store);
+            if (pid == SHORTENER_ENOFILE) printf("Start with --snapshot PATH to save snapshots.\n");
+            else if (pid == SHORTENER_ERUNNING) printf("A background save is already running.\n");
+            else if (pid > 0) printf("Background save started (pid %ld).\n", pid);
+            continue;
+        }
+
+        if (strcmp(cmd, "compact") == 0) {
+            int r = shortener_compact(store);
+            if (r == SHORTENER_ENOFILE) printf("Start with --wal PATH to compact a log.\n");
+            else if (r == SHORTENER_ERUNNING) printf("Log compaction is already running.\n");
+            else if (r == SHORTENER_EBUSY) printf("A background save is running.\n");
+            else if (r == 0) printf("The log is no bigger than compacting it would make it.\n");
+            else if (r == 1) printf("Log compaction started.\n");
+            continue;
+        }
+
+        if (strcmp(cmd, "train") == 0) {
+            unsigned n = shortener_train(store);
+            size_t raw, stored;
+            shortener_url_bytes(store, &raw, &stored);
+            if (n) printf("Trained %u symbols; URL bytes %zu raw / %zu stored.\n", n, raw, stored);
+            else printf("Nothing to train on.\n");
             continue;
         }
 
@@ -0,0 +1,4421 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "shortener.h"
+
+/* Short-code index implementation, chosen at build time:
+   default            - separately chained table (next_short links)
+   -DSHORT_INDEX_SWISS - open addressing with SIMD-probed control bytes
+   -DSHORT_INDEX_DENSE - nodes stored in a segmented array indexed by sequence id
+*/
+#if defined(SHORT_INDEX_SWISS) && defined(SHORT_INDEX_DENSE)
+#error "choose at most one of SHORT_INDEX_SWISS and SHORT_INDEX_DENSE"
+#endif
+#if !defined(SHORT_INDEX_SWISS) && !defined(SHORT_INDEX_DENSE)
+#define SHORT_INDEX_CHAINED
+#endif
+
+/* Long-URL (dedup) index, chosen at build time:
+   default                  - separately chained table (next_long links)
+   -DLONG_INDEX_FINGERPRINT - open-addressed array of 128-bit URL fingerprints
+*/
+#ifndef LONG_INDEX_FINGERPRINT
+#define LONG_INDEX_CHAINED
+#endif
+#if defined(SHORT_INDEX_CHAINED) || defined(LONG_INDEX_CHAINED)
+#define HAVE_HASH_TABLE
+#endif
+
+#ifdef SHORT_INDEX_SWISS
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#endif
+
+#define LONG_URL_MAX SHORTENER_URL_MAX
+#define SHORT_CODE_LEN SHORTENER_CODE_LEN
+
+/* Initial bucket count for both tables; override at build time or with --capacity.
+   Rounded up to a power of two so bucket indexes are a mask, not a divide.
+*/
+#ifndef INITIAL_CAPACITY
+#define INITIAL_CAPACITY 1024
+#endif
+
+/* Load-factor bounds (entries per bucket). A table doubles once it holds more than
+   MAX_LOAD entries per bucket and halves when it drops below 1/MIN_LOAD_DIV,
+   but never shrinks below its initial capacity. Sizes stay powers of two.
+*/
+#define MAX_LOAD 1
+#define MIN_LOAD_DIV 8
+
+static const char *BASE62 = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+// Scrambling configuration to avoid linear short codes
+#define MODULUS (1099511627776ULL)     // 2^40 space (~1.1 trillion unique codes) 
+#define PRIME_MULTIPLIER (36779219ULL)
+
+/* 7 base62 digits hold 62^7 (~3.5 trillion) values, more than MODULUS, so every
+   scrambled id encodes to a distinct code without truncation. Generated codes
+   therefore decode below MODULUS; the range [MODULUS, 62^7) is left free as a
+   separate namespace for custom aliases.
+*/
+#define CODE_SPACE (3521614606208ULL)  // 62^7
+#define ALIAS_CODE_MIN MODULUS
+_Static_assert(MODULUS <= CODE_SPACE, "scrambled ids must fit in SHORT_CODE_LEN base62 digits");
+// PRIME_MULTIPLIER * INVERSE_MULTIPLIER == 1 (mod 2^40); odd multipliers always have one
+#define INVERSE_MULTIPLIER (760078484315ULL)
+
+static uint64_t scramble_id(uint64_t sequential_id) {
+    if (sequential_id >= MODULUS) {
+        return 0;
+    }
+    uint64_t scrambled_id = (sequential_id * PRIME_MULTIPLIER) % MODULUS;
+    return scrambled_id;
+}
+
+// Inverse of scramble_id: recover the sequence number behind a scrambled id
+static uint64_t unscramble_id(uint64_t scrambled_id) {
+    if (scrambled_id >= MODULUS) {
+        return 0;
+    }
+    return (scrambled_id * INVERSE_MULTIPLIER) % MODULUS;
+}
+
+/* Nodes are sized to one cache line by default. Whatever the header leaves over
+   holds the URL inline (28 bytes with both chained indexes, 8 more for each one
+   replaced); longer URLs live in the URL arena. Raise NODE_BYTES to inline
+   longer URLs.
+*/
+#ifndef NODE_BYTES
+#define NODE_BYTES 64
+#endif
+#if defined(SHORT_INDEX_CHAINED) && defined(LONG_INDEX_CHAINED)
+#define NODE_LINK_BYTES 16
+#elif defined(SHORT_INDEX_CHAINED) || defined(LONG_INDEX_CHAINED)
+#define NODE_LINK_BYTES 8
+#else
+#define NODE_LINK_BYTES 0
+#endif
+#define NODE_HEADER_BYTES (8 + NODE_LINK_BYTES + 8 + 4)
+#define INLINE_URL_MAX (NODE_BYTES - NODE_HEADER_BYTES)
+
+// url_flags bits 
+#define URL_LIVE 0x01     // node holds a mapping
+#define URL_INLINE 0x02   // bytes are in url.inline_bytes, not the arena
+#define URL_HOSTDICT 0x04 // stored as host-dictionary id + rest of the URL
+#define URL_SYMBOLS 0x08  // rest of the URL is coded with the symbol table
+
+/* Single node used in both hash tables.
+   Each chained index gets a 'next' pointer: next_short for the short table and
+   next_long for the long table.
+   The short code is kept as the integer it encodes (below 62^7, so 42 bits).
+   The URL's full hash and length are cached so chain walks can reject most
+   candidates without touching the string, and unlinks never rehash it.
+   URL bytes are not NUL-terminated: url_len is the URL's length and stored_len
+   the length of its (possibly encoded) stored form.
+*/
+typedef struct Node {
+    uint64_t code;
+#ifdef SHORT_INDEX_CHAINED
+    struct Node *next_short; 
+#endif
+#ifdef LONG_INDEX_CHAINED
+    struct Node *next_long;  
+#endif
+    uint64_t url_hash;
+    union {
+        struct {
+            uint32_t url_len : 11;
+            uint32_t stored_len : 11;
+            uint32_t url_flags : 10;
+        };
+        uint32_t url_word;  // the three at once, as lookups load and changes store them
+    };
+    union {
+        char inline_bytes[INLINE_URL_MAX];
+        struct { uint32_t seg, off; } ref; // arena location
+    } url;
+} Node;
+
+_Static_assert(sizeof(Node) == NODE_BYTES, "NODE_BYTES must be a multiple of 8 above the node header");
+_Static_assert(LONG_URL_MAX + 4 < 2048, "url_len and stored_len are 11 bits");
+
+#ifdef HAVE_HASH_TABLE
+enum { TABLE_SHORT, TABLE_LONG };
+
+/* Growable chained hash table. 'kind' selects which of the node's next pointers
+   and which key (short code or long url) the table chains on.
+   While a resize is in progress the previous bucket array is kept in old_buckets;
+   buckets below rehash_pos have already been moved to the new array.
+*/
+typedef struct HashTable {
+    Node **buckets;
+    size_t size;       // number of buckets
+    size_t count;      // number of nodes
+    size_t min_size;   // never shrink below this
+    Node **old_buckets;
+    size_t old_size;
+    size_t rehash_pos; // next old bucket to migrate
+    int kind;
+} HashTable;
+#endif
+
+#ifdef SHORT_INDEX_SWISS
+/* SwissTable-style open addressing for short codes. Each slot has a control byte:
+   CTRL_EMPTY, CTRL_DELETED, or the top 7 bits of the key's hash (h2). Lookups load
+   a whole group of control bytes and compare them against h2 in one SIMD compare,
+   only touching slots whose tag matches. The first GROUP_WIDTH control bytes are
+   mirrored past the end so a group load never needs to wrap.
+*/
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+
+typedef struct SwissIndex {
+    int8_t *ctrl;       // capacity + GROUP_WIDTH bytes
+    Node **slots;
+    size_t capacity;    // power of two, at least GROUP_WIDTH
+    size_t count;
+    size_t tombstones;
+    size_t growth_left; // inserts into empty slots before a rehash
+    size_t min_capacity;
+} SwissIndex;
+#endif
+
+#ifdef SHORT_INDEX_DENSE
+/* Dense storage: the node for sequence number seq lives at a fixed position in a
+   segmented array, so a short code maps to its node with a base62 decode, one
+   multiply (unscramble_id) and two directory lookups. A 40-bit sequence number
+   splits into a top-level directory index, a second-level index and a slot.
+   Segments are allocated on first use and never move.
+*/
+#define DENSE_SLOT_BITS 16
+#define DENSE_DIR2_BITS 12
+#define DENSE_DIR1_BITS (40 - DENSE_SLOT_BITS - DENSE_DIR2_BITS)
+#define DENSE_SEG_NODES (1ULL << DENSE_SLOT_BITS)
+
+typedef struct DenseIndex {
+    Node **dir[1 << DENSE_DIR1_BITS]; // each: 1 << DENSE_DIR2_BITS segment pointers
+    size_t count;
+    size_t segments;
+    uint64_t end_seq;   // one past the highest sequence number ever claimed
+} DenseIndex;
+#endif
+
+#ifdef LONG_INDEX_FINGERPRINT
+/* Fingerprint dedup index: a Robin Hood open-addressed array with one 16-byte
+   entry per URL and no per-node links. The fingerprint is 128 bits: the URL's
+   hash (cached in the node, and whose top bits pick the home slot) plus a
+   second hash under another seed. An entry keeps the first half whole, FP_TAG_BITS
+   of the second, and the short code, so a new URL is settled by one probe run
+   that touches no nodes; only a fingerprint match reads the node to compare
+   the full URL. Resizes happen in one pass, like the Swiss index.
+*/
+#define FP_CODE_BITS 42
+#define FP_TAG_BITS (64 - FP_CODE_BITS)
+#define FP_CODE_MASK ((1ULL << FP_CODE_BITS) - 1)
+#define FP_SEED2 0x8ebc6af09c88c6e3ULL
+_Static_assert(CODE_SPACE <= (1ULL << FP_CODE_BITS), "codes must fit the entry's code field");
+
+typedef struct FpEntry {
+    uint64_t hi;        // first fingerprint half (never 0); 0 marks an empty slot
+    uint64_t tag_code;  // FP_TAG_BITS of the second half above the short code
+} FpEntry;
+
+typedef struct FpIndex {
+    FpEntry *slots;
+    size_t capacity;    // power of two
+    size_t count;
+    size_t min_capacity;
+    int shift;          // 64 - log2(capacity): home slot is hi >> shift
+} FpIndex;
+#endif
+
+#ifndef SHORT_INDEX_DENSE
+#ifndef SLAB_CHUNK_NODES
+#define SLAB_CHUNK_NODES 4096
+#endif
+
+typedef struct SlabChunk {
+    struct SlabChunk *next;
+    size_t used;        // nodes handed out from this chunk so far
+    _Alignas(64) Node nodes[]; // the header is padded so each node starts a cache line
+} SlabChunk;
+_Static_assert(offsetof(SlabChunk, nodes) % 64 == 0, "slab nodes must start on a cache line");
+
+typedef struct NodeSlab {
+    SlabChunk *chunks;  // newest first; only the head has unused room
+    Node *free_list;
+    size_t chunk_count;
+    size_t live;
+} NodeSlab;
+#endif
+typedef struct Shard Shard;
+
+/* Resumable walk over every live node of a run of shards, in storage order
+   (slab chunks or dense segments). Nodes created after the walk starts may
+   or may not be visited.
+*/
+typedef struct NodeCursor {
+    Shard *shard;       // the shard being walked
+    Shard *end;         // one past the last shard to walk
+#ifdef SHORT_INDEX_DENSE
+    uint64_t seq;
+    uint64_t seq_end;
+#else
+    SlabChunk *chunk;
+    size_t index;
+#endif
+} NodeCursor;
+#ifndef ARENA_SEG_BYTES
+#define ARENA_SEG_BYTES (1u << 20) // segment size for the whole store, split over the shards
+#endif
+#define ARENA_SEG_MIN (64u << 10)  // but never below this per shard
+_Static_assert(ARENA_SEG_MIN <= ARENA_SEG_BYTES && ARENA_SEG_MIN >= 2 * LONG_URL_MAX, "arena segments must hold URLs");
+#define COMPACT_STEP 256   // nodes visited per compaction step
+#ifndef IDLE_COMPACT_US
+#define IDLE_COMPACT_US 1000
+#endif
+
+typedef struct ArenaSeg {
+    char *data;       // NULL when the slot is free for a new segment
+    uint32_t used;
+    uint32_t dead;
+    int victim;       // being emptied by the current compaction pass
+} ArenaSeg;
+
+typedef struct UrlArena {
+    ArenaSeg *segs;
+    uint32_t seg_slots;
+    uint32_t tail;    // segment receiving appends (seg_slots when none)
+    uint32_t seg_bytes;  // size of each segment
+    size_t segments;  // allocated segments
+    size_t live_bytes;
+    size_t dead_bytes;
+    size_t inline_urls;
+    size_t raw_bytes;     // total length of live URLs
+    size_t stored_bytes;  // total length of their stored forms
+    int compacting;
+    NodeCursor cursor;
+    size_t moved_bytes;   // copied by compaction so far
+    size_t passes;        // completed compaction passes
+} UrlArena;
+#define HOST_PREFIX_MAX 255
+#define HOST_ID_LIMIT (1u << 21) // ids fit a 3-byte varint
+
+typedef struct HostEntry {
+    char *prefix;     // NULL while the id is free
+    uint32_t len;
+    uint32_t refs;
+    uint64_t hash;
+    int32_t next;     // bucket chain, or free-id list
+} HostEntry;
+
+typedef struct HostDict {
+    HostEntry *entries;
+    uint32_t count;   // ids handed out, free or not
+    uint32_t cap;
+    int32_t *buckets;
+    uint32_t nbuckets;
+    int32_t free_id;
+    size_t live;
+    size_t bytes;     // prefix bytes held
+} HostDict;
+#define SYM_MAX 255
+#define SYM_ESCAPE 255
+#define SYM_DECODE_SLACK 8
+#define SYM_TRAIN_ROUNDS 5
+#ifndef SYM_SAMPLE_BYTES
+#define SYM_SAMPLE_BYTES (64 * 1024)
+#endif
+
+typedef struct SymbolTable {
+    uint64_t sym[256];       // symbol bytes, little-endian, zero padded
+    uint8_t len[256];
+    uint8_t order[SYM_MAX];  // codes grouped by first byte, longest first
+    uint16_t first[257];     // order[first[b] .. first[b + 1]) start with byte b
+    unsigned count;
+} SymbolTable;
+#define WAL_MAGIC "URLWAL01"
+#define WAL_HEADER_BYTES 16
+#define WAL_INSERT 1
+#define WAL_DELETE 2
+#define WAL_SEQ 3
+#define WAL_IMAGE 4
+#define WAL_LEASE 5
+#define WAL_BUFFER_BYTES (64 * 1024)
+#define WAL_GROUP_MS 10
+#define WAL_RECORD_MAX (1 + 10 + 10 + LONG_URL_MAX + 4)
+
+enum { FSYNC_ALWAYS = SHORTENER_FSYNC_ALWAYS, FSYNC_GROUP = SHORTENER_FSYNC_GROUP, FSYNC_OS = SHORTENER_FSYNC_OS };
+
+typedef struct Wal {
+    int fd;             // -1 when there is no log
+    int active;         // records are appended (off while replaying)
+    int policy;
+    long group_ms;
+    const char *path;
+    uint64_t base_lsn;
+    uint64_t next_lsn;  // LSN of the next record appended
+    char *buf;          // appended, not yet written
+    size_t len;
+    size_t cap;
+    char *spare;        // the flusher writes from here while buf refills
+    size_t spare_cap;
+    pthread_t flusher;
+    pthread_mutex_t lock; // guards buf/len/cap and the counters
+    pthread_mutex_t io;   // held while writing to fd; taken before lock
+    pthread_cond_t wake;
+    int stopping;
+    uint64_t durable_lsn; // always policy: records below this LSN are synced
+    int syncing;          // a committer is writing and syncing for the others
+    pthread_cond_t synced;
+    uint64_t bytes;     // appended since startup
+    uint64_t file_bytes; // size of the log, counting records still buffered
+    uint64_t syncs;
+} Wal;
+#define SNAP_MAGIC "URLSNAP1"
+#ifndef SNAP_WARM_STEP
+#define SNAP_WARM_STEP 4096
+#endif
+#ifndef IDLE_WARM_US
+#define IDLE_WARM_US 2000
+#endif
+
+typedef struct SnapHeader {
+    char magic[8];
+    uint64_t count;
+    uint64_t next_lsn;     // first WAL record not reflected in the snapshot
+    uint64_t global_id;
+    uint64_t url_seed;
+    uint64_t index_slots;  // power of two
+    uint64_t blob_bytes;
+    uint64_t used_end;     // one past the highest sequence number handed out (0 before it was kept)
+} SnapHeader;
+
+typedef struct SnapEntry {
+    uint64_t code;
+    uint64_t off_len;      // blob offset << 16 | URL length
+} SnapEntry;
+
+_Static_assert(sizeof(SnapHeader) == 64 && sizeof(SnapEntry) == 16, "snapshot layout is fixed");
+
+typedef struct Snapshot {
+    const char *path;
+    uint8_t *map;          // NULL when no snapshot is being served
+    size_t map_bytes;
+    const SnapHeader *hdr;
+    const SnapEntry *entries;
+    const char *blob;
+    const uint32_t *index;
+    uint8_t *gone;         // bit per entry: deleted, or moved into the tables
+    size_t live;           // entries still served from the map
+    size_t warm_pos;       // next entry warm-up looks at
+} Snapshot;
+#ifndef LOG_COMPACT_STEP
+#define LOG_COMPACT_STEP 16
+#endif
+#define LOG_COMPACT_BUF (1 << 20)
+#ifndef IDLE_LOG_COMPACT_US
+#define IDLE_LOG_COMPACT_US 1000
+#endif
+#define WAL_COMPACT_RATIO 2
+#ifndef WAL_COMPACT_MIN
+#define WAL_COMPACT_MIN (4 << 20)
+#endif
+
+typedef struct LogCompaction {
+    int running;
+    int fd;               // the new log
+    char tmp[LONG_URL_MAX + 16];
+    uint64_t start_lsn;   // records from here on are copied from the old log
+    off_t start_offset;   // where they start in it
+    int walking_nodes;    // snapshot entries are done
+    size_t snap_pos;
+    NodeCursor cursor;
+    char *fill;           // the walk appends records here...
+    size_t fill_len;
+    char *out;            // ...while the writer thread writes this one out
+    size_t out_len;
+    pthread_t writer;
+    pthread_mutex_t lock; // guards out_len, stopping and written
+    pthread_cond_t cond;
+    int stopping;
+    size_t images;
+    uint64_t written;
+    double started;
+    unsigned completed;
+    double last_secs;
+    uint64_t last_before; // log size before and after the last compaction
+    uint64_t last_after;
+} LogCompaction;
+typedef struct SaveProgress {
+    uint64_t done;
+    uint64_t total;
+} SaveProgress;
+
+typedef struct BgSave {
+    pid_t pid;          // 0 while no save is running
+    int fd;             // parent: read end of the progress pipe; child: write end
+    uint64_t fork_lsn;  // the snapshot covers log records below this
+    off_t fork_offset;  // log size at the fork
+    double started;
+    double fork_ms;     // time the parent spent in fork()
+    SaveProgress progress;
+    double last_secs;   // duration of the last completed save, -1 if it failed
+    size_t last_count;
+    unsigned completed;
+} BgSave;
+
+/* A shard: the slice of both indexes whose keys hash to it, under its own
+   lock. A mapping's node, its URL storage and its short-code entry belong to
+   the shard of its code; its long-URL entry is in the shard of its URL,
+   which may be another one, so that entry can point at a node of any shard.
+*/
+struct Shard {
+    pthread_mutex_t lock;
+    shortener_t *sh;
+#if defined(SHORT_INDEX_SWISS)
+    SwissIndex short_index;
+#elif defined(SHORT_INDEX_DENSE)
+    DenseIndex short_index; // indexed by sequence number >> shard_bits
+#else
+    HashTable short_table;
+#endif
+#ifdef LONG_INDEX_CHAINED
+    HashTable long_table;
+#else
+    FpIndex long_index;
+#endif
+#ifndef SHORT_INDEX_DENSE
+    NodeSlab node_slab;
+#endif
+    UrlArena url_arena;
+    HostDict host_dict;
+    SymbolTable *url_symbols; // NULL until trained; replaced whole, so lookups decode with one table
+    unsigned seq;           // sequence count: odd while a write section is open
+    int write_depth;        // write sections open (they nest)
+    struct Retired *retired; // memory lock-free readers may still hold
+    size_t retired_count;
+    size_t retired_cap;
+    uint64_t lease_next;    // next sequence number of the shard's lease
+    uint64_t lease_end;     // one past its last
+    uint64_t leases;        // blocks leased since startup
+    uint64_t locks;         // times the lock was taken
+    uint64_t waits;         // ...of which it was held by another thread
+} __attribute__((aligned(64)));
+
+#ifndef SHARDS_MAX
+#define SHARDS_MAX 256
+#endif
+#ifndef LEASE_BLOCK
+#define LEASE_BLOCK 65536       // sequence numbers a shard leases at a time
+#endif
+
+/* A store: its shards, which hold both indexes over the same nodes (no
+   duplicate payloads) and the storage behind them, and the log and snapshot
+   that persist them. Only the hash seed, the CRC table and the reader
+   records are per process, so stores are independent.
+*/
+struct shortener {
+    Shard *shards;
+    unsigned shard_count;   // a power of two
+    unsigned shard_bits;
+    size_t initial_capacity; // per shard
+    size_t rehash_step;
+    uint64_t global_id;     // first sequence number not leased to a shard yet
+    int compress_hosts;     // --host-dict
+    Wal wal;
+    Snapshot snap;
+    LogCompaction log_compaction;
+    BgSave bgsave;
+    char *snap_path;        // copies of the paths the store was created with
+    char *wal_path;
+    pthread_mutex_t maint;  // background work run between shard locks (log compaction); taken first
+    uint64_t batch_leases;  // ranges leased by batch gens
+    uint64_t used_end;      // one past the highest sequence number handed out by a batch gen or an earlier run
+    uint64_t abandoned;     // never handed out: leased past the highest used when the store last stopped, batch leftovers
+    uint64_t cross;         // gens and dels that locked two shards
+    uint64_t backoffs;      // ...and had to let go of the first to take them in order
+    uint64_t read_retries;  // lock-free reads that had to start over
+};
+
+// Nodes a shard owns, one per mapping whose code falls in it
+static inline size_t shard_nodes(const Shard *sd) {
+#ifdef SHORT_INDEX_CHAINED
+    return sd->short_table.count;
+#else
+    return sd->short_index.count;
+#endif
+}
+
+// Live mappings
+static size_t mapping_count(const shortener_t *sh) {
+    size_t n = 0;
+    for (unsigned i = 0; i < sh->shard_count; ++i) n += shard_nodes(&sh->shards[i]);
+    return n;
+}
+
+// Total length of the live URLs, and of their stored (compressed) forms
+static void url_bytes(const shortener_t *sh, size_t *raw, size_t *stored) {
+    *raw = *stored = 0;
+    for (unsigned i = 0; i < sh->shard_count; ++i) {
+        *raw += sh->shards[i].url_arena.raw_bytes;
+        *stored += sh->shards[i].url_arena.stored_bytes;
+    }
+}
+
+/* Concurrency. Changes run under the lock of each shard they touch, so
+   changes to different shards go ahead side by side; whole-store work
+   (save, compaction, stats, ...) takes every shard's lock. Locks are always
+   taken in shard order. Lookups take no lock: a change that a lookup could
+   observe halfway is made inside a write section of its shard, which keeps
+   the shard's sequence count odd, and a lookup notes the (even) count when
+   it starts and starts over if it has moved by the time it is done. Within
+   a lookup, every pointer it loads is checked against the count before it
+   is followed, so it only follows pointers that were valid at that count.
+   Memory a write section takes out of use could still be in the hands of
+   such a lookup, so it is retired instead of freed: epoch-based reclamation
+   frees it once every lookup that was running at the time has finished.
+   Whatever a lookup loads, a write section stores with atomics too, so the
+   loads it discards are racy but never undefined.
+*/
+#ifndef RETIRE_BATCH
+#define RETIRE_BATCH 64     // retired blocks that trigger a reclaim
+#endif
+
+typedef struct Retired {
+    void *p;
+    size_t len;
+    void (*release)(void *p, size_t len);
+    uint64_t epoch;         // the epoch was advanced past this when p went out of use
+} Retired;
+
+/* A thread's reader record: the epoch it read when its current lookup
+   started, 0 between lookups. Records are never freed; a thread's record is
+   recycled once the thread exits.
+*/
+typedef struct ReaderRecord {
+    uint64_t epoch;
+    int in_use;
+    struct ReaderRecord *next;
+} __attribute__((aligned(64))) ReaderRecord;
+
+static uint64_t reader_epoch = 1;
+static ReaderRecord *reader_records;
+static pthread_key_t reader_key;
+static __thread ReaderRecord *reader_self;
+
+static void reader_thread_exit(void *arg) {
+    ReaderRecord *r = arg;
+    __atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static ReaderRecord *reader_record() {
+    ReaderRecord *r = reader_self;
+    if (r) return r;
+    for (r = __atomic_load_n(&reader_records, __ATOMIC_ACQUIRE); r; r = r->next) {
+        int idle = 0;
+        if (__atomic_compare_exchange_n(&r->in_use, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+    }
+    if (!r) {
+        r = aligned_alloc(64, sizeof(ReaderRecord));
+        if (!r) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        r->epoch = 0;
+        r->in_use = 1;
+        r->next = __atomic_load_n(&reader_records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&reader_records, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+    }
+    pthread_setspecific(reader_key, r);
+    reader_self = r;
+    return r;
+}
+
+/* Announce a lookup; the fence orders the announcement before its loads, and
+   the release orders the previous lookup's loads before whatever reclaim
+   frees on seeing it
+*/
+static inline void reader_enter(ReaderRecord *r) {
+    __atomic_store_n(&r->epoch, __atomic_load_n(&reader_epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void reader_exit(ReaderRecord *r) {
+    __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Even count to read at, waiting out an open write section
+static inline unsigned read_begin(const Shard *sd) {
+    unsigned s;
+    for (int spins = 0; (s = __atomic_load_n(&sd->seq, __ATOMIC_ACQUIRE)) & 1; ++spins) {
+        if (spins < 64) cpu_relax();
+        else sched_yield();
+    }
+    return s;
+}
+
+// Whether everything loaded since read_begin returned s is still consistent
+static inline int read_valid(const Shard *sd, unsigned s) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&sd->seq, __ATOMIC_RELAXED) == s;
+}
+
+static inline void write_begin(Shard *sd) {
+    if (sd->write_depth++) return;
+    __atomic_store_n(&sd->seq, sd->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_end(Shard *sd) {
+    if (--sd->write_depth) return;
+    __atomic_store_n(&sd->seq, sd->seq + 1, __ATOMIC_RELEASE);
+}
+
+// A write section on every shard, for changes to what they share (the snapshot)
+static void write_begin_all(shortener_t *sh) {
+    for (unsigned i = 0; i < sh->shard_count; ++i) write_begin(&sh->shards[i]);
+}
+
+static void write_end_all(shortener_t *sh) {
+    for (unsigned i = 0; i < sh->shard_count; ++i) write_end(&sh->shards[i]);
+}
+
+/* Fields lookups load while a write section may store them are accessed
+   whole with relaxed atomics on both sides; the count is what orders them.
+   An array or string filled in before anything points at it is published
+   with a release store and loaded with acquire, so it is seen filled in.
+*/
+#define LOAD_SHARED(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE_SHARED(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define LOAD_PUBLISHED(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define PUBLISH(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+/* URL bytes a lookup may be copying while they change: a word at a time
+   where the shared side is aligned, bytes at either end
+*/
+typedef uint64_t __attribute__((may_alias)) shared_word;
+
+static inline void load_shared_bytes(char *dst, const char *src, size_t n) {
+    size_t i = 0;
+    for (; i < n && ((uintptr_t)(src + i) & 7); ++i) dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w = __atomic_load_n((const shared_word *)(src + i), __ATOMIC_RELAXED);
+        memcpy(dst + i, &w, 8);
+    }
+    for (; i < n; ++i) dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+static inline void store_shared_bytes(char *dst, const char *src, size_t n) {
+    size_t i = 0;
+    for (; i < n && ((uintptr_t)(dst + i) & 7); ++i) __atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, src + i, 8);
+        __atomic_store_n((shared_word *)(dst + i), w, __ATOMIC_RELAXED);
+    }
+    for (; i < n; ++i) __atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+}
+
+static void release_free(void *p, size_t len) {
+    (void)len;
+    free(p);
+}
+
+static void release_unmap(void *p, size_t len) {
+    munmap(p, len);
+}
+
+// Release what no running lookup can still hold (everything with all set)
+static void reclaim(Shard *sd, int all) {
+    uint64_t oldest = UINT64_MAX;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (ReaderRecord *r = __atomic_load_n(&reader_records, __ATOMIC_ACQUIRE); r && !all; r = r->next) {
+        uint64_t e = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE);
+        if (e && e < oldest) oldest = e;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < sd->retired_count; ++i) {
+        Retired *x = &sd->retired[i];
+        if (all || x->epoch < oldest) x->release(x->p, x->len);
+        else sd->retired[kept++] = *x;
+    }
+    sd->retired_count = kept;
+}
+
+/* Hand p to release once no lookup can hold it; p must already be out of
+   the structures lookups reach
+*/
+static void retire(Shard *sd, void *p, size_t len, void (*release)(void *p, size_t len)) {
+    if (!p) return;
+    if (sd->retired_count == sd->retired_cap) {
+        size_t cap = sd->retired_cap ? sd->retired_cap * 2 : RETIRE_BATCH * 2;
+        Retired *r = realloc(sd->retired, cap * sizeof(Retired));
+        if (!r) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        sd->retired = r;
+        sd->retired_cap = cap;
+    }
+    // a lookup that started at this epoch or before may hold p; later ones cannot reach it
+    uint64_t e = __atomic_fetch_add(&reader_epoch, 1, __ATOMIC_SEQ_CST);
+    sd->retired[sd->retired_count++] = (Retired){ p, len, release, e };
+    if (sd->retired_count % RETIRE_BATCH == 0) reclaim(sd, 0);
+}
+
+/* Shards are picked by the top half of a multiply with a constant of its
+   own, so the pick is independent of the hash bits the indexes use inside
+   a shard (bucket, Swiss tag and fingerprint home slot).
+*/
+static inline unsigned shard_pick(const shortener_t *sh, uint64_t h) {
+    return (unsigned)((h * 0xD6E8FEB86659FD93ULL) >> 32) & (sh->shard_count - 1);
+}
+
+// The shard owning a code: its node, URL and short-code entry
+static inline Shard *shard_of_code(shortener_t *sh, uint64_t code) {
+#ifdef SHORT_INDEX_DENSE
+    // consecutive sequence numbers go round the shards, so each fills its array densely
+    return &sh->shards[code < ALIAS_CODE_MIN ? unscramble_id(code) & (sh->shard_count - 1) : 0];
+#else
+    return &sh->shards[shard_pick(sh, code)];
+#endif
+}
+
+// The shard holding the long-URL entry for a URL hash
+static inline Shard *shard_of_url(shortener_t *sh, uint64_t url_hash) {
+    return &sh->shards[shard_pick(sh, url_hash)];
+}
+
+static void shard_lock(Shard *sd) {
+    if (pthread_mutex_trylock(&sd->lock) != 0) {
+        pthread_mutex_lock(&sd->lock);
+        sd->waits++;
+    }
+    sd->locks++;
+}
+
+static void shard_unlock(Shard *sd) {
+    pthread_mutex_unlock(&sd->lock);
+}
+
+/* With a held, take b as well (a no-op when they are the same). Locks go in
+   shard order, so when b comes first a is let go and both are taken again in
+   order; that returns 0, and whatever was looked up under a alone has to be
+   looked up again.
+*/
+static int shard_lock_second(shortener_t *sh, Shard *a, Shard *b) {
+    if (a == b) return 1;
+    __atomic_fetch_add(&sh->cross, 1, __ATOMIC_RELAXED);
+    if (b > a) {
+        shard_lock(b);
+        return 1;
+    }
+    if (pthread_mutex_trylock(&b->lock) == 0) {
+        b->locks++;
+        return 1;
+    }
+    __atomic_fetch_add(&sh->backoffs, 1, __ATOMIC_RELAXED);
+    shard_unlock(a);
+    shard_lock(b);
+    shard_lock(a);
+    return 0;
+}
+
+// Every shard's lock, for whole-store work
+static void shards_lock_all(shortener_t *sh) {
+    for (unsigned i = 0; i < sh->shard_count; ++i) shard_lock(&sh->shards[i]);
+}
+
+static void shards_unlock_all(shortener_t *sh) {
+    for (unsigned i = sh->shard_count; i-- > 0;) shard_unlock(&sh->shards[i]);
+}
+
+/* Old buckets migrated per table operation while resizing; 0 resizes in one go.
+   Idle time (between commands) migrates more, bounded by IDLE_REHASH_US.
+*/
+#ifndef REHASH_STEP
+#define REHASH_STEP 4
+#endif
+#ifndef IDLE_REHASH_US
+#define IDLE_REHASH_US 1000
+#endif
+
+/* Per-process seed mixed into every string hash, so colliding URLs cannot be
+   precomputed offline to flood a chain (set by init_hash_seed).
+*/
+static uint64_t hash_seed = 0x243F6A8885A308D3ULL;
+
+// djb2 hashing, kept for comparison (-DHASH_DJB2 selects it for the tables)
+static uint64_t hash_djb2(const char *str, size_t len) {
+    uint64_t hash = 5381;
+    for (size_t i = 0; i < len; ++i)
+        hash = ((hash << 5) + hash) + (unsigned char)str[i];
+    return hash;
+}
+
+/* wyhash-style hashing: reads 8 bytes at a time and folds 128-bit products,
+   48 bytes per round for long keys. Based on wyhash final v4 (public domain).
+*/
+#define WY_S0 0xa0761d6478bd642fULL
+#define WY_S1 0xe7037ed1a0b428dbULL
+#define WY_S2 0x8ebc6af09c88c6e3ULL
+#define WY_S3 0x589965cc75374cc3ULL
+
+static inline uint64_t wy_mix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t wy_read8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t wy_read4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint64_t hash_bytes(const void *key, size_t len, uint64_t seed) {
+    const uint8_t *p = key;
+    uint64_t a, b;
+    seed ^= wy_mix(seed ^ WY_S0, WY_S1);
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (wy_read4(p) << 32) | wy_read4(p + ((len >> 3) << 2));
+            b = (wy_read4(p + len - 4) << 32) | wy_read4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wy_mix(wy_read8(p) ^ WY_S1, wy_read8(p + 8) ^ seed);
+                see1 = wy_mix(wy_read8(p + 16) ^ WY_S2, wy_read8(p + 24) ^ see1);
+                see2 = wy_mix(wy_read8(p + 32) ^ WY_S3, wy_read8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wy_mix(wy_read8(p) ^ WY_S1, wy_read8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = wy_read8(p + i - 16);
+        b = wy_read8(p + i - 8);
+    }
+    __uint128_t r = (__uint128_t)(a ^ WY_S1) * (b ^ seed);
+    return wy_mix((uint64_t)r ^ WY_S0 ^ len, (uint64_t)(r >> 64) ^ WY_S1);
+}
+
+// url hashing used by the tables (full value; callers mask it to a bucket index)
+static uint64_t hash_url(const char *url, size_t len) {
+#ifdef HASH_DJB2
+    return hash_djb2(url, len);
+#else
+    return hash_bytes(url, len, hash_seed);
+#endif
+}
+
+// Pick a fresh seed from the OS, falling back to clock and pid bits
+static void init_hash_seed() {
+    uint64_t seed = 0;
+    FILE *f = fopen("/dev/urandom", "rb");
+    if (!f || fread(&seed, sizeof(seed), 1, f) != 1) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        seed = ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)ts.tv_nsec ^ ((uint64_t)getpid() << 16)
+             ^ (uint64_t)(uintptr_t)&seed;
+    }
+    if (f) fclose(f);
+    hash_seed = wy_mix(seed ^ WY_S2, WY_S3);
+}
+
+#ifdef HAVE_HASH_TABLE
+static Node **next_of(const HashTable *t, Node *n) {
+#if defined(SHORT_INDEX_CHAINED) && defined(LONG_INDEX_CHAINED)
+    return t->kind == TABLE_SHORT ? &n->next_short : &n->next_long;
+#elif defined(SHORT_INDEX_CHAINED)
+    (void)t;
+    return &n->next_short;
+#else
+    (void)t;
+    return &n->next_long;
+#endif
+}
+
+/* Short codes are already spread by scramble_id; a multiply and fold is enough
+   to make the low bits usable as a bucket index.
+*/
+static inline uint64_t hash_code(uint64_t code) {
+    uint64_t h = code * 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 32);
+}
+
+static uint64_t node_hash(const HashTable *t, const Node *n) {
+    return t->kind == TABLE_SHORT ? hash_code(n->code) : n->url_hash;
+}
+
+static Node **alloc_buckets(size_t size) {
+    Node **b = calloc(size, sizeof(Node *));
+    if (!b) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return b;
+}
+
+static void table_init(HashTable *t, int kind, size_t capacity) {
+    size_t pow2 = 1;
+    while (pow2 < capacity) pow2 <<= 1;
+    capacity = pow2;
+    t->buckets = alloc_buckets(capacity);
+    t->size = capacity;
+    t->count = 0;
+    t->min_size = capacity;
+    t->old_buckets = NULL;
+    t->old_size = 0;
+    t->rehash_pos = 0;
+    t->kind = kind;
+}
+
+static int table_rehashing(const HashTable *t) {
+    return t->old_buckets != NULL;
+}
+
+/* Chain head that currently owns keys hashing to h: the old bucket if it has
+   not been migrated yet, otherwise the bucket in the new array.
+*/
+static Node **head_for(HashTable *t, uint64_t h) {
+    if (t->old_buckets) {
+        size_t i = h & (t->old_size - 1);
+        if (i >= t->rehash_pos) return &t->old_buckets[i];
+    }
+    return &t->buckets[h & (t->size - 1)];
+}
+
+/* Migrate up to n old buckets into the new array. Empty buckets are cheap but
+   still bounded (10 per requested bucket) so a sparse table cannot stall us.
+   Returns 1 while a rehash is still in progress.
+*/
+static int table_rehash_step(Shard *sd, HashTable *t, size_t n) {
+    size_t empty_visits = n * 10;
+    write_begin(sd);
+    while (n > 0 && t->rehash_pos < t->old_size) {
+        Node *cur = t->old_buckets[t->rehash_pos];
+        if (!cur) {
+            STORE_SHARED(t->rehash_pos, t->rehash_pos + 1);
+            if (--empty_visits == 0) break;
+            continue;
+        }
+        while (cur) {
+            Node *next = *next_of(t, cur);
+            size_t h = node_hash(t, cur) & (t->size - 1);
+            STORE_SHARED(*next_of(t, cur), t->buckets[h]);
+            STORE_SHARED(t->buckets[h], cur);
+            cur = next;
+        }
+        STORE_SHARED(t->old_buckets[t->rehash_pos], NULL);
+        STORE_SHARED(t->rehash_pos, t->rehash_pos + 1);
+        n--;
+    }
+    int more = t->rehash_pos < t->old_size;
+    if (!more) {
+        retire(sd, t->old_buckets, 0, release_free);
+        STORE_SHARED(t->old_buckets, NULL);
+        STORE_SHARED(t->old_size, 0);
+        STORE_SHARED(t->rehash_pos, 0);
+    }
+    write_end(sd);
+    return more;
+}
+
+// Start moving nodes into a bucket array of new_size buckets
+static void table_resize(Shard *sd, HashTable *t, size_t new_size) {
+    STORE_SHARED(t->old_buckets, t->buckets);
+    STORE_SHARED(t->old_size, t->size);
+    STORE_SHARED(t->rehash_pos, 0);
+    PUBLISH(t->buckets, alloc_buckets(new_size));
+    STORE_SHARED(t->size, new_size);
+    if (sd->sh->rehash_step == 0) table_rehash_step(sd, t, SIZE_MAX);
+}
+
+/* Grow or shrink according to the load-factor bounds; while a resize is in
+   progress, advance it instead.
+*/
+static void table_check_load(Shard *sd, HashTable *t) {
+    if (table_rehashing(t)) {
+        table_rehash_step(sd, t, sd->sh->rehash_step);
+    } else if (t->count > t->size * MAX_LOAD) {
+        table_resize(sd, t, t->size * 2);
+    } else if (t->size > t->min_size && t->count < t->size / MIN_LOAD_DIV) {
+        size_t ns = t->size / 2;
+        if (ns < t->min_size) ns = t->min_size;
+        table_resize(sd, t, ns);
+    }
+}
+
+// Idle-time migration: keep moving buckets until done or the time budget runs out
+static void table_rehash_idle(Shard *sd, HashTable *t, long budget_us) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (table_rehashing(t) && table_rehash_step(sd, t, 256)) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed = (now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000;
+        if (elapsed >= budget_us) break;
+    }
+}
+
+static size_t nonempty_buckets(const HashTable *t) {
+    size_t n = 0;
+    for (size_t i = t->rehash_pos; i < t->old_size; i++)
+        if (t->old_buckets[i]) n++;
+    for (size_t i = 0; i < t->size; i++)
+        if (t->buckets[i]) n++;
+    return n;
+}
+#endif
+
+#ifdef SHORT_INDEX_SWISS
+/* Group primitives: each returns a bitmask with bit i set when control byte i of
+   the group matches. AVX2 probes 32 bytes, SSE2 16, and the portable fallback
+   loops over 16.
+*/
+#if defined(__AVX2__)
+#define GROUP_WIDTH 32
+static inline uint32_t group_match(const int8_t *g, int8_t h2) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)g);
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(h2)));
+}
+static inline uint32_t group_match_free(const int8_t *g) {
+    // empty and deleted are the only negative control bytes
+    return (uint32_t)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)g));
+}
+#elif defined(__SSE2__)
+#define GROUP_WIDTH 16
+static inline uint32_t group_match(const int8_t *g, int8_t h2) {
+    __m128i v = _mm_loadu_si128((const __m128i *)g);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(h2)));
+}
+static inline uint32_t group_match_free(const int8_t *g) {
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)g));
+}
+#else
+#define GROUP_WIDTH 16
+static inline uint32_t group_match(const int8_t *g, int8_t h2) {
+    uint32_t m = 0;
+    for (int i = 0; i < GROUP_WIDTH; ++i)
+        if (g[i] == h2) m |= 1u << i;
+    return m;
+}
+static inline uint32_t group_match_free(const int8_t *g) {
+    uint32_t m = 0;
+    for (int i = 0; i < GROUP_WIDTH; ++i)
+        if (g[i] < 0) m |= 1u << i;
+    return m;
+}
+#endif
+
+static inline uint32_t group_match_empty(const int8_t *g) {
+    return group_match(g, CTRL_EMPTY);
+}
+
+// h1 (low bits) picks the start group, h2 (top 7 bits) is the tag
+static inline uint64_t swiss_hash(uint64_t code) {
+    return code * 0x9E3779B97F4A7C15ULL;
+}
+#define SWISS_H1(h) ((size_t)((h) >> 7))
+#define SWISS_H2(h) ((int8_t)((h) >> 57))
+
+static void swiss_alloc(SwissIndex *s, size_t capacity) {
+    int8_t *ctrl = malloc(capacity + GROUP_WIDTH);
+    Node **slots = calloc(capacity, sizeof(Node *));
+    if (!ctrl || !slots) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    memset(ctrl, CTRL_EMPTY, capacity + GROUP_WIDTH);
+    PUBLISH(s->ctrl, ctrl);
+    PUBLISH(s->slots, slots);
+    STORE_SHARED(s->capacity, capacity);
+    s->count = 0;
+    s->tombstones = 0;
+    s->growth_left = capacity - capacity / 8; // max load 7/8
+}
+
+static void swiss_init(SwissIndex *s, size_t capacity) {
+    size_t cap = GROUP_WIDTH;
+    while (cap < capacity) cap <<= 1;
+    swiss_alloc(s, cap);
+    s->min_capacity = cap;
+}
+
+static void swiss_set_ctrl(SwissIndex *s, size_t i, int8_t c) {
+    STORE_SHARED(s->ctrl[i], c);
+    if (i < GROUP_WIDTH) STORE_SHARED(s->ctrl[s->capacity + i], c);
+}
+
+/* Probe groups in triangular order (offsets 0, 1, 3, 6 ... groups), which visits
+   every group of a power-of-two table exactly once.
+*/
+static Node *swiss_find(const SwissIndex *s, uint64_t key) {
+    uint64_t h = swiss_hash(key);
+    size_t mask = s->capacity - 1;
+    size_t pos = SWISS_H1(h) & mask;
+    int8_t h2 = SWISS_H2(h);
+    for (size_t step = GROUP_WIDTH;; step += GROUP_WIDTH) {
+        const int8_t *g = s->ctrl + pos;
+        for (uint32_t m = group_match(g, h2); m; m &= m - 1) {
+            Node *n = s->slots[(pos + __builtin_ctz(m)) & mask];
+            if (n->code == key) return n;
+        }
+        if (group_match_empty(g)) return NULL;
+        pos = (pos + step) & mask;
+    }
+}
+
+// First empty or deleted slot on the probe sequence for h
+static size_t swiss_find_free(const SwissIndex *s, uint64_t h) {
+    size_t mask = s->capacity - 1;
+    size_t pos = SWISS_H1(h) & mask;
+    for (size_t step = GROUP_WIDTH;; step += GROUP_WIDTH) {
+        uint32_t m = group_match_free(s->ctrl + pos);
+        if (m) return (pos + __builtin_ctz(m)) & mask;
+        pos = (pos + step) & mask;
+    }
+}
+
+static void swiss_place(SwissIndex *s, Node *node) {
+    uint64_t h = swiss_hash(node->code);
+    size_t i = swiss_find_free(s, h);
+    if (s->ctrl[i] == CTRL_EMPTY) s->growth_left--;
+    else s->tombstones--;
+    swiss_set_ctrl(s, i, SWISS_H2(h));
+    STORE_SHARED(s->slots[i], node);
+    s->count++;
+}
+
+// Rebuild into new_capacity slots, dropping tombstones
+static void swiss_rehash(Shard *sd, SwissIndex *s, size_t new_capacity) {
+    SwissIndex old = *s;
+    swiss_alloc(s, new_capacity);
+    s->min_capacity = old.min_capacity;
+    for (size_t i = 0; i < old.capacity; ++i)
+        if (old.ctrl[i] >= 0) swiss_place(s, old.slots[i]);
+    retire(sd, old.ctrl, 0, release_free);
+    retire(sd, old.slots, 0, release_free);
+}
+
+static void swiss_insert(Shard *sd, SwissIndex *s, Node *node) {
+    if (s->growth_left == 0) {
+        // mostly tombstones: rebuild in place; otherwise double
+        if (s->count * 2 < s->capacity) swiss_rehash(sd, s, s->capacity);
+        else swiss_rehash(sd, s, s->capacity * 2);
+    }
+    swiss_place(s, node);
+}
+
+// Remove the slot holding exactly this node; shrinks when the table gets sparse
+static int swiss_erase(Shard *sd, SwissIndex *s, Node *node) {
+    uint64_t h = swiss_hash(node->code);
+    size_t mask = s->capacity - 1;
+    size_t pos = SWISS_H1(h) & mask;
+    int8_t h2 = SWISS_H2(h);
+    for (size_t step = GROUP_WIDTH;; step += GROUP_WIDTH) {
+        const int8_t *g = s->ctrl + pos;
+        for (uint32_t m = group_match(g, h2); m; m &= m - 1) {
+            size_t i = (pos + __builtin_ctz(m)) & mask;
+            if (s->slots[i] != node) continue;
+            swiss_set_ctrl(s, i, CTRL_DELETED);
+            STORE_SHARED(s->slots[i], NULL);
+            s->count--;
+            s->tombstones++;
+            if (s->capacity > s->min_capacity && s->count < s->capacity / (MIN_LOAD_DIV * 2))
+                swiss_rehash(sd, s, s->capacity / 2);
+            return 1;
+        }
+        if (group_match_empty(g)) return 0;
+        pos = (pos + step) & mask;
+    }
+}
+
+#endif
+
+#ifdef SHORT_INDEX_DENSE
+#define DENSE_DIR2_MASK ((1u << DENSE_DIR2_BITS) - 1)
+
+// Node slot for seq, or NULL if its segment was never allocated
+static Node *dense_slot(const DenseIndex *d, uint64_t seq) {
+    Node **dir2 = d->dir[seq >> (DENSE_SLOT_BITS + DENSE_DIR2_BITS)];
+    if (!dir2) return NULL;
+    Node *seg = dir2[(seq >> DENSE_SLOT_BITS) & DENSE_DIR2_MASK];
+    if (!seg) return NULL;
+    return &seg[seq & (DENSE_SEG_NODES - 1)];
+}
+
+// Node slot for seq, allocating its directory and segment on first use
+static Node *dense_claim(DenseIndex *d, uint64_t seq) {
+    Node ***dir2 = &d->dir[seq >> (DENSE_SLOT_BITS + DENSE_DIR2_BITS)];
+    if (!*dir2) {
+        Node **fresh = calloc(1u << DENSE_DIR2_BITS, sizeof(Node *));
+        if (!fresh) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        PUBLISH(*dir2, fresh);
+    }
+    Node **seg = &(*dir2)[(seq >> DENSE_SLOT_BITS) & DENSE_DIR2_MASK];
+    if (!*seg) {
+        Node *fresh = aligned_alloc(64, DENSE_SEG_NODES * sizeof(Node));
+        if (!fresh) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        memset(fresh, 0, DENSE_SEG_NODES * sizeof(Node));
+        PUBLISH(*seg, fresh);
+        d->segments++;
+    }
+    if (seq >= d->end_seq) d->end_seq = seq + 1;
+    return &(*seg)[seq & (DENSE_SEG_NODES - 1)];
+}
+
+
+static void dense_free(DenseIndex *d) {
+    for (size_t i = 0; i < (1u << DENSE_DIR1_BITS); ++i) {
+        if (!d->dir[i]) continue;
+        for (size_t j = 0; j <= DENSE_DIR2_MASK; ++j)
+            free(d->dir[i][j]);
+        free(d->dir[i]);
+        d->dir[i] = NULL;
+    }
+    d->count = 0;
+    d->segments = 0;
+    d->end_seq = 0;
+}
+#endif
+
+#ifdef LONG_INDEX_FINGERPRINT
+static inline size_t fp_home(const FpIndex *f, uint64_t hi) {
+    return (size_t)(hi >> f->shift);
+}
+
+// Probe distance of the entry in slot pos from its home slot
+static inline size_t fp_dist(const FpIndex *f, size_t pos) {
+    return (pos - fp_home(f, f->slots[pos].hi)) & (f->capacity - 1);
+}
+
+// A URL hash as the first fingerprint half: 0 is reserved for empty slots
+static inline uint64_t fp_hi(uint64_t url_hash) {
+    return url_hash ? url_hash : 1;
+}
+
+static inline uint64_t fp_tag(uint64_t lo) {
+    return lo >> FP_CODE_BITS << FP_CODE_BITS;
+}
+
+static void fp_alloc(FpIndex *f, size_t capacity) {
+    f->slots = calloc(capacity, sizeof(FpEntry));
+    if (!f->slots) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    f->capacity = capacity;
+    f->count = 0;
+    f->shift = 64 - __builtin_ctzll(capacity);
+}
+
+static void fp_init(FpIndex *f, size_t capacity) {
+    size_t cap = 2;
+    while (cap < capacity) cap <<= 1;
+    fp_alloc(f, cap);
+    f->min_capacity = cap;
+}
+
+// Robin Hood insert: an entry further from home takes the slot of a closer one
+static void fp_place(FpIndex *f, FpEntry e) {
+    size_t mask = f->capacity - 1;
+    size_t pos = fp_home(f, e.hi), dist = 0;
+    for (;; pos = (pos + 1) & mask, ++dist) {
+        FpEntry *s = &f->slots[pos];
+        if (!s->hi) {
+            *s = e;
+            f->count++;
+            return;
+        }
+        size_t d = fp_dist(f, pos);
+        if (d < dist) {
+            FpEntry t = *s;
+            *s = e;
+            e = t;
+            dist = d;
+        }
+    }
+}
+
+static void fp_resize(FpIndex *f, size_t new_capacity) {
+    FpIndex old = *f;
+    fp_alloc(f, new_capacity);
+    for (size_t i = 0; i < old.capacity; ++i)
+        if (old.slots[i].hi) fp_place(f, old.slots[i]);
+    free(old.slots);
+}
+
+// Grows past a 7/8 load factor
+static void fp_insert(FpIndex *f, uint64_t hi, uint64_t lo, uint64_t code) {
+    if ((f->count + 1) * 8 > f->capacity * 7) fp_resize(f, f->capacity * 2);
+    fp_place(f, (FpEntry){ fp_hi(hi), fp_tag(lo) | code });
+}
+
+// Remove the entry for this (hash, code) pair; backward-shift keeps probe runs tombstone-free
+static int fp_erase(FpIndex *f, uint64_t hi, uint64_t code) {
+    size_t mask = f->capacity - 1;
+    hi = fp_hi(hi);
+    size_t pos = fp_home(f, hi);
+    for (size_t dist = 0;; pos = (pos + 1) & mask, ++dist) {
+        const FpEntry *s = &f->slots[pos];
+        if (!s->hi || fp_dist(f, pos) < dist) return 0;
+        if (s->hi == hi && (s->tag_code & FP_CODE_MASK) == code) break;
+    }
+    for (;;) {
+        size_t next = (pos + 1) & mask;
+        if (!f->slots[next].hi || fp_dist(f, next) == 0) break;
+        f->slots[pos] = f->slots[next];
+        pos = next;
+    }
+    f->slots[pos].hi = 0;
+    f->count--;
+    if (f->capacity > f->min_capacity && f->count < f->capacity / (MIN_LOAD_DIV * 2))
+        fp_resize(f, f->capacity / 2);
+    return 1;
+}
+#endif
+
+#ifndef SHORT_INDEX_DENSE
+/* Slab allocator for nodes: nodes are carved out of large cache-line aligned
+   chunks instead of one malloc each, each node on a cache line of its own at
+   the default NODE_BYTES. Freed nodes go on an intrusive free list
+   (linked through their URL bytes) and are reused first. A node is live while
+   URL_LIVE is set, so chunks can be walked front to back, and tearing down
+   the store releases whole chunks.
+*/
+
+static inline Node *slab_next_free(const Node *n) {
+    Node *next;
+    memcpy(&next, n->url.inline_bytes, sizeof(next));
+    return next;
+}
+
+static size_t slab_chunk_bytes() {
+    // nodes start at a cache line after the header; round up so aligned_alloc accepts the size
+    return (offsetof(SlabChunk, nodes) + SLAB_CHUNK_NODES * sizeof(Node) + 63) & ~(size_t)63;
+}
+
+static Node *slab_alloc(NodeSlab *s) {
+    Node *n = s->free_list;
+    if (n) {
+        s->free_list = slab_next_free(n);
+    } else {
+        if (!s->chunks || s->chunks->used == SLAB_CHUNK_NODES) {
+            SlabChunk *c = aligned_alloc(64, slab_chunk_bytes());
+            if (!c) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+            c->used = 0;
+            c->next = s->chunks;
+            s->chunks = c;
+            s->chunk_count++;
+        }
+        n = &s->chunks->nodes[s->chunks->used++];
+    }
+    s->live++;
+    return n;
+}
+
+// The node stays readable to lookups, which find it no longer live
+static void slab_free(NodeSlab *s, Node *n) {
+    STORE_SHARED(n->url_word, 0);
+    store_shared_bytes(n->url.inline_bytes, (const char *)&s->free_list, sizeof(Node *));
+    s->free_list = n;
+    s->live--;
+}
+
+// Give every chunk back at once; nodes must not be used afterwards
+static void slab_release_all(NodeSlab *s) {
+    SlabChunk *c = s->chunks;
+    while (c) {
+        SlabChunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    memset(s, 0, sizeof(*s));
+}
+#endif
+
+
+// Position c at the start of its current shard
+static void cursor_enter(NodeCursor *c) {
+#ifdef SHORT_INDEX_DENSE
+    c->seq = 0;
+    c->seq_end = c->shard->short_index.end_seq;
+#else
+    c->chunk = c->shard->node_slab.chunks;
+    c->index = 0;
+#endif
+}
+
+// Walk the shards [first, end)
+static void cursor_start(NodeCursor *c, Shard *first, Shard *end) {
+    c->shard = first;
+    c->end = end;
+    cursor_enter(c);
+}
+
+// Next live node (of c->shard), or NULL once the walk is complete
+static Node *cursor_next(NodeCursor *c) {
+    while (c->shard < c->end) {
+#ifdef SHORT_INDEX_DENSE
+        while (c->seq < c->seq_end) {
+            Node *n = dense_slot(&c->shard->short_index, c->seq);
+            if (!n) {
+                // unallocated segment: skip to the next one
+                c->seq = (c->seq | (DENSE_SEG_NODES - 1)) + 1;
+                continue;
+            }
+            c->seq++;
+            if (n->url_flags & URL_LIVE) return n;
+        }
+#else
+        while (c->chunk) {
+            if (c->index >= c->chunk->used) {
+                c->chunk = c->chunk->next;
+                c->index = 0;
+                continue;
+            }
+            Node *n = &c->chunk->nodes[c->index++];
+            if (n->url_flags & URL_LIVE) return n;
+        }
+#endif
+        if (++c->shard < c->end) cursor_enter(c);
+    }
+    return NULL;
+}
+
+/* URL arena: URLs too long to inline are appended to large segments and
+   referenced by (segment, offset); the node's url_len gives the extent, so the
+   arena stores bare bytes with no per-URL header or malloc overhead. Deleting
+   a URL only counts its bytes as dead. Once dead bytes pile up, a compaction
+   pass marks the mostly-dead segments as victims, walks all nodes in bounded
+   steps moving URLs out of victims to the tail, then frees the victims whole.
+   Segments are ARENA_SEG_BYTES split over the shards, so a store's unfilled
+   tails add up to about one segment however it is sharded.
+*/
+
+static uint32_t arena_new_segment(Shard *sd, UrlArena *a) {
+    uint32_t i = 0;
+    while (i < a->seg_slots && a->segs[i].data) i++;
+    if (i == a->seg_slots) {
+        // a copy, not realloc: lookups may still be reading the old array
+        uint32_t slots = a->seg_slots ? a->seg_slots * 2 : 16;
+        ArenaSeg *segs = calloc(slots, sizeof(ArenaSeg));
+        if (!segs) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        if (a->seg_slots) memcpy(segs, a->segs, a->seg_slots * sizeof(ArenaSeg));
+        retire(sd, a->segs, 0, release_free);
+        PUBLISH(a->segs, segs);
+        a->seg_slots = slots;
+    }
+    ArenaSeg *s = &a->segs[i];
+    char *data = malloc(a->seg_bytes);
+    if (!data) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    STORE_SHARED(s->data, data);
+    s->used = s->dead = 0;
+    s->victim = 0;
+    a->segments++;
+    return i;
+}
+
+// Copy len bytes to the tail segment and return where they landed
+static void arena_append(Shard *sd, UrlArena *a, const char *bytes, size_t len, uint32_t *seg, uint32_t *off) {
+    if (a->tail >= a->seg_slots || !a->segs[a->tail].data || a->segs[a->tail].used + len > a->seg_bytes)
+        a->tail = arena_new_segment(sd, a);
+    ArenaSeg *s = &a->segs[a->tail];
+    store_shared_bytes(s->data + s->used, bytes, len);
+    *seg = a->tail;
+    *off = s->used;
+    s->used += (uint32_t)len;
+    a->live_bytes += len;
+}
+
+// Account len bytes at seg as garbage
+static void arena_drop(UrlArena *a, uint32_t seg, size_t len) {
+    a->segs[seg].dead += (uint32_t)len;
+    a->live_bytes -= len;
+    a->dead_bytes += len;
+}
+
+/* Host dictionary (--host-dict): the "scheme://host[:port]" prefix shared by
+   most URLs is interned once, and nodes store a varint dictionary id followed
+   by the rest of the URL. Entries are reference counted by the nodes using
+   them; ids of unused entries are recycled.
+*/
+
+static size_t varint_put(uint8_t *out, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+static size_t varint_get(const uint8_t *in, uint64_t *v) {
+    uint64_t r = 0;
+    size_t n = 0;
+    int shift = 0;
+    do {
+        r |= (uint64_t)(in[n] & 0x7f) << shift;
+        shift += 7;
+    } while (in[n++] & 0x80);
+    *v = r;
+    return n;
+}
+
+/* Length of the "scheme://host[:port]" prefix of url (up to the first '/', '?'
+   or '#' after the host), or 0 if the URL does not start that way.
+*/
+static size_t url_host_prefix(const char *url, size_t len) {
+    size_t i = 0;
+    while (i < len && i < 16 && url[i] != ':') i++;
+    if (i == 0 || i + 3 > len || i == 16 || memcmp(url + i, "://", 3) != 0) return 0;
+    size_t host = i + 3, end = host;
+    while (end < len && url[end] != '/' && url[end] != '?' && url[end] != '#') end++;
+    if (end == host || end > HOST_PREFIX_MAX) return 0;
+    return end;
+}
+
+static int32_t hostdict_find(const HostDict *d, const char *prefix, size_t len, uint64_t h) {
+    if (!d->nbuckets) return -1;
+    for (int32_t i = d->buckets[h & (d->nbuckets - 1)]; i >= 0; i = d->entries[i].next) {
+        const HostEntry *e = &d->entries[i];
+        if (e->hash == h && e->len == len && memcmp(e->prefix, prefix, len) == 0) return i;
+    }
+    return -1;
+}
+
+static void hostdict_grow_buckets(HostDict *d) {
+    uint32_t nb = d->nbuckets ? d->nbuckets * 2 : 64;
+    int32_t *b = malloc(nb * sizeof(int32_t));
+    if (!b) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    memset(b, 0xff, nb * sizeof(int32_t));
+    for (uint32_t i = 0; i < d->count; ++i) {
+        HostEntry *e = &d->entries[i];
+        if (!e->prefix) continue;
+        e->next = b[e->hash & (nb - 1)];
+        b[e->hash & (nb - 1)] = (int32_t)i;
+    }
+    free(d->buckets);
+    d->buckets = b;
+    d->nbuckets = nb;
+}
+
+// Take a reference on prefix, adding it if new; -1 once the id space is full
+static int32_t hostdict_intern(Shard *sd, HostDict *d, const char *prefix, size_t len) {
+    uint64_t h = hash_url(prefix, len);
+    int32_t id = hostdict_find(d, prefix, len, h);
+    if (id >= 0) {
+        d->entries[id].refs++;
+        return id;
+    }
+    if (d->free_id >= 0) {
+        id = d->free_id;
+        d->free_id = d->entries[id].next;
+    } else {
+        if (d->count == HOST_ID_LIMIT) return -1;
+        if (d->count == d->cap) {
+            // a copy, not realloc: lookups may still be reading the old array
+            uint32_t cap = d->cap ? d->cap * 2 : 64;
+            HostEntry *e = malloc(cap * sizeof(HostEntry));
+            if (!e) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+            if (d->count) memcpy(e, d->entries, d->count * sizeof(HostEntry));
+            retire(sd, d->entries, 0, release_free);
+            PUBLISH(d->entries, e);
+            d->cap = cap;
+        }
+        id = (int32_t)d->count++;
+    }
+    if (d->live + 1 > d->nbuckets) hostdict_grow_buckets(d);
+    HostEntry *e = &d->entries[id];
+    char *copy = malloc(len);
+    if (!copy) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    memcpy(copy, prefix, len);
+    PUBLISH(e->prefix, copy);
+    STORE_SHARED(e->len, (uint32_t)len);
+    e->refs = 1;
+    e->hash = h;
+    e->next = d->buckets[h & (d->nbuckets - 1)];
+    d->buckets[h & (d->nbuckets - 1)] = id;
+    d->live++;
+    d->bytes += len;
+    return id;
+}
+
+static void hostdict_release(Shard *sd, HostDict *d, uint32_t id) {
+    HostEntry *e = &d->entries[id];
+    if (--e->refs > 0) return;
+    int32_t *link = &d->buckets[e->hash & (d->nbuckets - 1)];
+    while (*link != (int32_t)id) link = &d->entries[*link].next;
+    *link = e->next;
+    retire(sd, e->prefix, 0, release_free);
+    STORE_SHARED(e->prefix, NULL);
+    d->live--;
+    d->bytes -= e->len;
+    e->next = d->free_id;
+    d->free_id = (int32_t)id;
+}
+
+static void hostdict_free(HostDict *d) {
+    for (uint32_t i = 0; i < d->count; ++i) free(d->entries[i].prefix);
+    free(d->entries);
+    free(d->buckets);
+    memset(d, 0, sizeof(*d));
+    d->free_id = -1;
+}
+
+/* Symbol table (the "train" command): up to 255 symbols of 1-8 bytes, picked
+   from a sample of stored URLs for the bytes they save, in the style of FSST.
+   A URL is coded as one byte per symbol, with SYM_ESCAPE followed by a literal
+   byte for anything the table lacks. Decoding copies a whole 8-byte word per
+   code and advances by the symbol's length, so it needs SYM_DECODE_SLACK
+   spare bytes after the output. Coding is deterministic for a given table, so
+   a lookup codes its key once and compares coded bytes.
+*/
+
+static inline uint64_t load_tail(const char *p, size_t n) {
+    uint64_t v = 0;
+    memcpy(&v, p, n < 8 ? n : 8);
+    return v;
+}
+
+static inline uint64_t sym_mask(unsigned len) {
+    return len == 8 ? ~0ULL : (1ULL << (8 * len)) - 1;
+}
+
+// Longest symbol matching at p (n bytes left), or -1
+static int sym_match(const SymbolTable *t, const char *p, size_t n) {
+    uint64_t w = load_tail(p, n);
+    uint8_t b = (uint8_t)p[0];
+    for (unsigned i = t->first[b]; i < t->first[b + 1]; ++i) {
+        unsigned c = t->order[i];
+        if (t->len[c] <= n && (w & sym_mask(t->len[c])) == t->sym[c]) return (int)c;
+    }
+    return -1;
+}
+
+// Code n bytes into out; SIZE_MAX if the result would exceed limit bytes
+static size_t sym_encode(const SymbolTable *t, const char *in, size_t n, uint8_t *out, size_t limit) {
+    size_t o = 0;
+    for (size_t i = 0; i < n;) {
+        int c = sym_match(t, in + i, n - i);
+        if (c >= 0) {
+            if (o + 1 > limit) return SIZE_MAX;
+            out[o++] = (uint8_t)c;
+            i += t->len[c];
+        } else {
+            if (o + 2 > limit) return SIZE_MAX;
+            out[o++] = SYM_ESCAPE;
+            out[o++] = (uint8_t)in[i++];
+        }
+    }
+    return o;
+}
+
+/* Decode n coded bytes into out (room for the URL plus SYM_DECODE_SLACK).
+   Four codes at a time while none of them is an escape.
+*/
+static size_t sym_decode(const SymbolTable *t, const uint8_t *in, size_t n, char *out) {
+    char *p = out;
+    size_t i = 0;
+    while (i + 4 <= n) {
+        uint32_t w;
+        memcpy(&w, in + i, 4);
+        uint32_t esc = ~w;
+        if ((esc - 0x01010101u) & ~esc & 0x80808080u) break; // a 0xFF byte
+        for (int k = 0; k < 4; ++k) {
+            uint8_t c = in[i + k];
+            memcpy(p, &t->sym[c], 8);
+            p += t->len[c];
+        }
+        i += 4;
+    }
+    while (i < n) {
+        uint8_t c = in[i++];
+        if (c != SYM_ESCAPE) {
+            memcpy(p, &t->sym[c], 8);
+            p += t->len[c];
+        } else {
+            *p++ = (char)in[i++];
+        }
+    }
+    return (size_t)(p - out);
+}
+
+typedef struct SymCandidate {
+    uint64_t sym;
+    uint8_t len;
+    uint64_t gain;
+} SymCandidate;
+
+static int cmp_candidate_sym(const void *a, const void *b) {
+    const SymCandidate *x = a, *y = b;
+    if (x->len != y->len) return x->len < y->len ? -1 : 1;
+    return x->sym < y->sym ? -1 : x->sym > y->sym;
+}
+
+static int cmp_candidate_gain(const void *a, const void *b) {
+    const SymCandidate *x = a, *y = b;
+    if (x->gain != y->gain) return x->gain > y->gain ? -1 : 1;
+    return cmp_candidate_sym(a, b);
+}
+
+// Rebuild the first-byte index after the symbols change
+static void sym_index(SymbolTable *t) {
+    unsigned pos = 0;
+    for (unsigned b = 0; b < 256; ++b) {
+        t->first[b] = (uint16_t)pos;
+        for (unsigned l = 8; l >= 1; --l)
+            for (unsigned c = 0; c < t->count; ++c)
+                if (t->len[c] == l && (uint8_t)t->sym[c] == b) t->order[pos++] = (uint8_t)c;
+    }
+    t->first[256] = (uint16_t)pos;
+    t->sym[SYM_ESCAPE] = 0;
+    t->len[SYM_ESCAPE] = 0;
+}
+
+/* Train t on the sample strings. Each round codes the sample with the current
+   table, counting how often each symbol (or literal byte) and each adjacent
+   pair occurs; symbols and pair concatenations are then ranked by the bytes
+   they cover and the best SYM_MAX kept.
+*/
+static void sym_train(SymbolTable *t, const char *const *sample, const size_t *lens, size_t n) {
+    // codes 0..254 are symbols, 256 + b the literal byte b
+    enum { CODES = 512 };
+    uint32_t *single = malloc(CODES * sizeof(uint32_t));
+    uint32_t *pair = malloc((size_t)CODES * CODES * sizeof(uint32_t));
+    SymCandidate *cand = malloc((CODES + (size_t)CODES * CODES) * sizeof(SymCandidate));
+    if (!single || !pair || !cand) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    memset(t, 0, sizeof(*t));
+    sym_index(t);
+    for (int round = 0; round < SYM_TRAIN_ROUNDS; ++round) {
+        memset(single, 0, CODES * sizeof(uint32_t));
+        memset(pair, 0, (size_t)CODES * CODES * sizeof(uint32_t));
+        for (size_t s = 0; s < n; ++s) {
+            const char *p = sample[s];
+            size_t len = lens[s], i = 0;
+            int prev = -1;
+            while (i < len) {
+                int c = sym_match(t, p + i, len - i);
+                int code = c >= 0 ? c : 256 + (uint8_t)p[i];
+                i += c >= 0 ? t->len[c] : 1;
+                single[code]++;
+                if (prev >= 0) pair[prev * CODES + code]++;
+                prev = code;
+            }
+        }
+        size_t nc = 0;
+        for (int a = 0; a < CODES; ++a) {
+            if (!single[a]) continue;
+            uint64_t sa = a < 256 ? t->sym[a] : (uint64_t)(a - 256);
+            unsigned la = a < 256 ? t->len[a] : 1;
+            cand[nc++] = (SymCandidate){ sa, (uint8_t)la, (uint64_t)single[a] * la };
+            if (la == 8) continue;
+            for (int b = 0; b < CODES; ++b) {
+                uint32_t f = pair[a * CODES + b];
+                if (!f) continue;
+                uint64_t sb = b < 256 ? t->sym[b] : (uint64_t)(b - 256);
+                unsigned lb = b < 256 ? t->len[b] : 1;
+                unsigned l = la + lb > 8 ? 8 : la + lb;
+                uint64_t v = (sa | sb << (8 * la)) & sym_mask(l);
+                cand[nc++] = (SymCandidate){ v, (uint8_t)l, (uint64_t)f * l };
+            }
+        }
+        // merge duplicates, then keep the highest gains
+        qsort(cand, nc, sizeof(SymCandidate), cmp_candidate_sym);
+        size_t m = 0;
+        for (size_t i = 0; i < nc; ++i) {
+            if (m && cand[m - 1].len == cand[i].len && cand[m - 1].sym == cand[i].sym)
+                cand[m - 1].gain += cand[i].gain;
+            else
+                cand[m++] = cand[i];
+        }
+        qsort(cand, m, sizeof(SymCandidate), cmp_candidate_gain);
+        t->count = m < SYM_MAX ? (unsigned)m : SYM_MAX;
+        for (unsigned c = 0; c < t->count; ++c) {
+            t->sym[c] = cand[c].sym;
+            t->len[c] = cand[c].len;
+        }
+        sym_index(t);
+    }
+    free(single);
+    free(pair);
+    free(cand);
+}
+
+// Stored bytes of the node's URL (stored_len of them)
+static inline const char *node_stored(Shard *sd, const Node *n) {
+    if (n->url_flags & URL_INLINE) return n->url.inline_bytes;
+    return sd->url_arena.segs[n->url.ref.seg].data + n->url.ref.off;
+}
+
+// Store a URL for a fresh node: host-encoded when enabled, inline when it fits
+static void node_set_url(Shard *sd, Node *n, const char *url, size_t len) {
+    char buf[LONG_URL_MAX + 4];
+    const char *bytes = url;
+    size_t stored = len, head = 0, skip = 0;
+    unsigned flags = URL_LIVE;
+    if (sd->sh->compress_hosts) {
+        size_t plen = url_host_prefix(url, len);
+        int32_t id = plen ? hostdict_intern(sd, &sd->host_dict, url, plen) : -1;
+        if (id >= 0) {
+            head = varint_put((uint8_t *)buf, (uint64_t)id);
+            skip = plen;
+            flags |= URL_HOSTDICT;
+        }
+    }
+    if (sd->url_symbols && sd->url_symbols->count && len > skip) {
+        // keep the coded form only when it is shorter
+        size_t coded = sym_encode(sd->url_symbols, url + skip, len - skip, (uint8_t *)buf + head,
+                                  len - skip - 1);
+        if (coded != SIZE_MAX) {
+            bytes = buf;
+            stored = head + coded;
+            flags |= URL_SYMBOLS;
+        }
+    }
+    if (flags & URL_HOSTDICT && !(flags & URL_SYMBOLS)) {
+        memcpy(buf + head, url + skip, len - skip);
+        bytes = buf;
+        stored = head + len - skip;
+    }
+    if (stored <= INLINE_URL_MAX) {
+        store_shared_bytes(n->url.inline_bytes, bytes, stored);
+        flags |= URL_INLINE;
+        sd->url_arena.inline_urls++;
+    } else {
+        uint32_t seg, off;
+        arena_append(sd, &sd->url_arena, bytes, stored, &seg, &off);
+        STORE_SHARED(n->url.ref.seg, seg);
+        STORE_SHARED(n->url.ref.off, off);
+    }
+    Node h;
+    h.url_word = 0;
+    h.url_len = len;
+    h.stored_len = stored;
+    h.url_flags = flags;
+    STORE_SHARED(n->url_word, h.url_word);
+    sd->url_arena.raw_bytes += len;
+    sd->url_arena.stored_bytes += stored;
+}
+
+static void node_clear_url(Shard *sd, Node *n) {
+    if (n->url_flags & URL_HOSTDICT) {
+        uint64_t id;
+        varint_get((const uint8_t *)node_stored(sd, n), &id);
+        hostdict_release(sd, &sd->host_dict, id);
+    }
+    if (n->url_flags & URL_INLINE) sd->url_arena.inline_urls--;
+    else arena_drop(&sd->url_arena, n->url.ref.seg, n->stored_len);
+    sd->url_arena.raw_bytes -= n->url_len;
+    sd->url_arena.stored_bytes -= n->stored_len;
+    Node h = { .url_word = n->url_word };
+    h.url_flags = 0;
+    STORE_SHARED(n->url_word, h.url_word);
+}
+
+/* Reassemble the node's URL into out, which must hold url_len bytes plus
+   SYM_DECODE_SLACK; t is the table the node was coded with.
+*/
+static size_t node_decode_url(Shard *sd, const Node *n, const SymbolTable *t, char *out) {
+    const char *s = node_stored(sd, n);
+    size_t k = 0, o = 0;
+    if (n->url_flags & URL_HOSTDICT) {
+        uint64_t id;
+        k = varint_get((const uint8_t *)s, &id);
+        const HostEntry *e = &sd->host_dict.entries[id];
+        memcpy(out, e->prefix, e->len);
+        o = e->len;
+    }
+    if (n->url_flags & URL_SYMBOLS) sym_decode(t, (const uint8_t *)s + k, n->stored_len - k, out + o);
+    else memcpy(out + o, s + k, n->stored_len - k);
+    return n->url_len;
+}
+
+static size_t node_read_url(Shard *sd, const Node *n, char *out) {
+    return node_decode_url(sd, n, sd->url_symbols, out);
+}
+
+/* A URL being looked up: its hash, plus its host-dictionary id and coded form
+   once needed, so candidates are compared in stored form without decoding.
+*/
+typedef struct UrlKey {
+    const char *url;
+    size_t len;
+    uint64_t hash;
+#ifdef LONG_INDEX_FINGERPRINT
+    uint64_t fp_lo;    // second fingerprint half
+#endif
+    int32_t host_id;   // -1: prefix not in the dictionary, -2: not looked up yet
+    size_t prefix_len;
+    size_t coded_from; // offset coded[] starts from, SIZE_MAX if not coded yet
+    size_t coded_len;  // SIZE_MAX if coding does not shrink it
+    uint8_t coded[LONG_URL_MAX];
+} UrlKey;
+
+// A key whose hashes are already set, with nothing looked up or coded yet
+static void url_key_reset(UrlKey *k, const char *url, size_t len) {
+    k->url = url;
+    k->len = len;
+    k->host_id = -2;
+    k->prefix_len = 0;
+    k->coded_from = SIZE_MAX;
+}
+
+static void url_key_init(UrlKey *k, const char *url, size_t len) {
+    k->hash = hash_url(url, len);
+#ifdef LONG_INDEX_FINGERPRINT
+    k->fp_lo = hash_bytes(url, len, hash_seed ^ FP_SEED2);
+#endif
+    url_key_reset(k, url, len);
+}
+
+// Compare a node whose hash and length already match against the key
+static int node_url_matches(Shard *sd, const Node *n, UrlKey *k) {
+    const char *s = node_stored(sd, n);
+    size_t slen = n->stored_len, off = 0;
+    if (n->url_flags & URL_HOSTDICT) {
+        if (k->host_id == -2) {
+            k->prefix_len = url_host_prefix(k->url, k->len);
+            k->host_id = k->prefix_len ? hostdict_find(&sd->host_dict, k->url, k->prefix_len,
+                                                       hash_url(k->url, k->prefix_len)) : -1;
+        }
+        if (k->host_id < 0) return 0;
+        uint64_t id;
+        size_t idlen = varint_get((const uint8_t *)s, &id);
+        if (id != (uint64_t)k->host_id) return 0;
+        s += idlen;
+        slen -= idlen;
+        off = k->prefix_len;
+    }
+    if (n->url_flags & URL_SYMBOLS) {
+        if (k->coded_from != off) {
+            size_t rest = k->len - off;
+            k->coded_len = rest ? sym_encode(sd->url_symbols, k->url + off, rest, k->coded, rest - 1) : SIZE_MAX;
+            k->coded_from = off;
+        }
+        return k->coded_len == slen && memcmp(s, k->coded, slen) == 0;
+    }
+    return slen == k->len - off && memcmp(s, k->url + off, slen) == 0;
+}
+
+/* Start a pass when at least a third of the arena is garbage and some segment
+   is at least half dead. A mostly-dead tail is sealed and compacted too, with
+   appends moving on to a fresh one; under churn it is where most URLs die.
+*/
+static void arena_maybe_compact(Shard *sd, UrlArena *a) {
+    if (a->compacting || a->dead_bytes < a->seg_bytes || a->dead_bytes * 2 < a->live_bytes)
+        return;
+    int victims = 0;
+    for (uint32_t i = 0; i < a->seg_slots; ++i) {
+        ArenaSeg *s = &a->segs[i];
+        if (s->data && s->dead * 2 >= s->used) {
+            s->victim = 1;
+            victims++;
+        }
+    }
+    if (!victims) return;
+    if (a->tail < a->seg_slots && a->segs[a->tail].victim) a->tail = a->seg_slots;
+    a->compacting = 1;
+    cursor_start(&a->cursor, sd, sd + 1);
+}
+
+// Visit up to budget nodes of the current pass; returns 1 while a pass is running
+static int arena_compact_step(Shard *sd, UrlArena *a, size_t budget) {
+    if (!a->compacting) return 0;
+    int done = 0;
+    write_begin(sd);
+    while (budget-- > 0) {
+        Node *n = cursor_next(&a->cursor);
+        if (!n) {
+            done = 1;
+            break;
+        }
+        if ((n->url_flags & URL_INLINE) || !a->segs[n->url.ref.seg].victim) continue;
+        // a victim tail was sealed, so this copy cannot land in one
+        uint32_t seg, off;
+        arena_append(sd, a, node_stored(sd, n), n->stored_len, &seg, &off);
+        arena_drop(a, n->url.ref.seg, n->stored_len);
+        STORE_SHARED(n->url.ref.seg, seg);
+        STORE_SHARED(n->url.ref.off, off);
+        a->moved_bytes += n->stored_len;
+    }
+    if (done) {
+        // walk finished: every URL has left the victims, which now hold only garbage
+        for (uint32_t i = 0; i < a->seg_slots; ++i) {
+            ArenaSeg *s = &a->segs[i];
+            if (!s->victim) continue;
+            a->dead_bytes -= s->dead;
+            retire(sd, s->data, 0, release_free);
+            STORE_SHARED(s->data, NULL);
+            s->used = s->dead = 0;
+            s->victim = 0;
+            a->segments--;
+        }
+        a->compacting = 0;
+        a->passes++;
+    }
+    write_end(sd);
+    return !done;
+}
+
+static void arena_compact_idle(Shard *sd, UrlArena *a, long budget_us) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (arena_compact_step(sd, a, COMPACT_STEP)) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed = (now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000;
+        if (elapsed >= budget_us) break;
+    }
+}
+
+/* Switch a shard (held) to symbol table t, recoding its URLs with it.
+   Lookups decode with the live table, so they wait for the whole recode.
+*/
+static void shard_recode(Shard *sd, const SymbolTable *t) {
+    char url[LONG_URL_MAX + SYM_DECODE_SLACK];
+    SymbolTable *fresh = malloc(sizeof(SymbolTable));
+    if (!fresh) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    *fresh = *t;
+    write_begin(sd);
+    SymbolTable *old = sd->url_symbols;
+    PUBLISH(sd->url_symbols, fresh);
+    // recode in place: the node keeps its position in both tables
+    NodeCursor c;
+    cursor_start(&c, sd, sd + 1);
+    for (Node *node; (node = cursor_next(&c));) {
+        size_t len = node_decode_url(sd, node, old, url);
+        node_clear_url(sd, node);
+        node_set_url(sd, node, url, len);
+    }
+    // the old copies are now dead; finish any running pass, then reclaim them
+    while (arena_compact_step(sd, &sd->url_arena, SIZE_MAX))
+        ;
+    arena_maybe_compact(sd, &sd->url_arena);
+    while (arena_compact_step(sd, &sd->url_arena, SIZE_MAX))
+        ;
+    if (old) retire(sd, old, 0, release_free);
+    write_end(sd);
+}
+
+/* Train the symbol table on a sample of the stored URLs (the part after the
+   host prefix when that is interned), then recode every URL with it. The
+   sample is taken with every shard held; training runs unlocked and each
+   shard is then recoded under its own lock. Returns the number of symbols,
+   0 with nothing to train on.
+*/
+static unsigned train_url_symbols(shortener_t *sh) {
+    shards_lock_all(sh);
+    size_t live = mapping_count(sh), raw, stored;
+    url_bytes(sh, &raw, &stored);
+    if (!live) {
+        shards_unlock_all(sh);
+        return 0;
+    }
+    size_t avg = (raw + live - 1) / live;
+    size_t stride = live * avg / SYM_SAMPLE_BYTES + 1;
+    size_t cap = SYM_SAMPLE_BYTES / (avg ? avg : 1) + 1, n = 0, bytes = 0, seen = 0;
+    char **sample = malloc(cap * sizeof(char *));
+    size_t *lens = malloc(cap * sizeof(size_t));
+    if (!sample || !lens) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    char url[LONG_URL_MAX + SYM_DECODE_SLACK];
+    NodeCursor c;
+    cursor_start(&c, sh->shards, sh->shards + sh->shard_count);
+    for (Node *node; n < cap && bytes < SYM_SAMPLE_BYTES && (node = cursor_next(&c));) {
+        if (seen++ % stride) continue;
+        size_t len = node_read_url(c.shard, node, url);
+        size_t skip = sh->compress_hosts ? url_host_prefix(url, len) : 0;
+        sample[n] = malloc(len - skip + 1);
+        if (!sample[n]) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        memcpy(sample[n], url + skip, len - skip);
+        lens[n] = len - skip;
+        bytes += lens[n++];
+    }
+    shards_unlock_all(sh);
+
+    SymbolTable t;
+    sym_train(&t, (const char *const *)sample, lens, n);
+    for (size_t i = 0; i < n; ++i) free(sample[i]);
+    free(sample);
+    free(lens);
+    for (unsigned i = 0; i < sh->shard_count; ++i) {
+        shard_lock(&sh->shards[i]);
+        shard_recode(&sh->shards[i], &t);
+        shard_unlock(&sh->shards[i]);
+    }
+    return t.count;
+}
+
+static void arena_release_all(UrlArena *a) {
+    for (uint32_t i = 0; i < a->seg_slots; ++i) free(a->segs[i].data);
+    free(a->segs);
+    memset(a, 0, sizeof(*a));
+}
+
+/* Write-ahead log (--wal PATH): every insert and delete appends a small record
+   before it touches the tables, and startup replays the log to rebuild both
+   indexes and global_id. Every block of sequence numbers a shard leases is
+   logged and synced before any of it is handed out, whatever the policy.
+
+   File: a WAL_HEADER_BYTES header (magic, then the LSN of the first record as
+   a little-endian u64) followed by records:
+     INSERT  type, varint code, varint url length, url bytes, CRC-32C
+     DELETE  type, varint code, CRC-32C
+     LEASE   type, varint end of the leased block, CRC-32C
+     SEQ     type, varint global_id, CRC-32C              (compacted logs only)
+     IMAGE   type, varint code, varint url length, url bytes, CRC-32C  (ditto)
+   The CRC covers the record bytes before it. Records carry no LSN of their
+   own: the n-th INSERT, DELETE or LEASE after the header has LSN
+   base_lsn + n. A
+   compacted log starts with a SEQ record and an IMAGE of every live mapping,
+   which take no LSNs; see "Log compaction" below.
+
+   --fsync picks when an appended record becomes durable:
+     always  - written and fdatasync'ed before the command returns. The
+               record is appended under the shard locks; once they are let
+               go, one waiting command writes and syncs everything appended
+               so far while the others wait for it, so concurrent commands
+               share one fdatasync (see wal_commit)
+     group:N - a flusher thread writes and syncs whatever accumulated every
+               N ms, so a crash loses at most the last N ms of commands
+     os      - written when the buffer fills or between commands; the OS syncs
+*/
+
+static uint32_t crc32c_table[256];
+
+static void crc32c_init() {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) c = c & 1 ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+        crc32c_table[i] = c;
+    }
+}
+
+static uint32_t crc32c(const uint8_t *p, size_t n) {
+    uint32_t c = ~0u;
+    while (n--) c = crc32c_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+    return ~c;
+}
+
+static void wal_write_fd(int fd, const char *p, size_t n) {
+    while (n) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "WAL write failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        p += w;
+        n -= (size_t)w;
+    }
+}
+
+static void wal_write_all(shortener_t *sh, const char *p, size_t n) {
+    wal_write_fd(sh->wal.fd, p, n);
+}
+
+static void wal_sync_fd(int fd) {
+    if (fdatasync(fd) != 0) {
+        fprintf(stderr, "WAL sync failed: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+static void wal_sync(shortener_t *sh) {
+    wal_sync_fd(sh->wal.fd);
+}
+
+static void wal_reserve(char **buf, size_t *cap, size_t need) {
+    if (need <= *cap) return;
+    size_t c = *cap ? *cap : WAL_BUFFER_BYTES;
+    while (c < need) c *= 2;
+    char *b = realloc(*buf, c);
+    if (!b) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    *buf = b;
+    *cap = c;
+}
+
+// Write out what has been appended; the group flusher does this on its own
+static void wal_flush(shortener_t *sh, int sync) {
+    if (sh->wal.len) {
+        wal_write_all(sh, sh->wal.buf, sh->wal.len);
+        sh->wal.len = 0;
+    }
+    if (sync) {
+        wal_sync(sh);
+        sh->wal.syncs++;
+    }
+}
+
+// Writers on different shards append at once, so the buffer is always locked
+static void wal_append(shortener_t *sh, const uint8_t *rec, size_t n) {
+    pthread_mutex_lock(&sh->wal.lock);
+    wal_reserve(&sh->wal.buf, &sh->wal.cap, sh->wal.len + n);
+    memcpy(sh->wal.buf + sh->wal.len, rec, n);
+    sh->wal.len += n;
+    sh->wal.bytes += n;
+    sh->wal.file_bytes += n;
+    sh->wal.next_lsn++;
+    if (sh->wal.policy == FSYNC_OS && sh->wal.len >= WAL_BUFFER_BYTES) wal_flush(sh, 0);
+    pthread_mutex_unlock(&sh->wal.lock);
+}
+
+static size_t wal_seal(uint8_t *rec, size_t n) {
+    uint32_t crc = crc32c(rec, n);
+    for (int i = 0; i < 4; ++i) rec[n++] = (uint8_t)(crc >> (8 * i));
+    return n;
+}
+
+// An INSERT or IMAGE record for code -> url into rec; returns its length
+static size_t wal_encode_mapping(uint8_t *rec, int type, uint64_t code, const char *url, size_t len) {
+    size_t n = 0;
+    rec[n++] = (uint8_t)type;
+    n += varint_put(rec + n, code);
+    n += varint_put(rec + n, len);
+    memcpy(rec + n, url, len);
+    return wal_seal(rec, n + len);
+}
+
+static void wal_log_insert(shortener_t *sh, uint64_t code, const char *url, size_t len) {
+    if (!sh->wal.active) return;
+    uint8_t rec[WAL_RECORD_MAX];
+    wal_append(sh, rec, wal_encode_mapping(rec, WAL_INSERT, code, url, len));
+}
+
+static void wal_log_delete(shortener_t *sh, uint64_t code) {
+    if (!sh->wal.active) return;
+    uint8_t rec[WAL_RECORD_MAX];
+    size_t n = 0;
+    rec[n++] = WAL_DELETE;
+    n += varint_put(rec + n, code);
+    wal_append(sh, rec, wal_seal(rec, n));
+}
+
+/* Called with lock held; returns with lock and io held. Swaps the filled
+   buffer for the spare and returns it (n bytes) for the caller to write
+   with only io held, while appenders fill the other one
+*/
+static char *wal_take(shortener_t *sh, size_t *n) {
+    // take io before the buffer so records reach the file in order
+    pthread_mutex_unlock(&sh->wal.lock);
+    pthread_mutex_lock(&sh->wal.io);
+    pthread_mutex_lock(&sh->wal.lock);
+    char *b = sh->wal.buf;
+    size_t c = sh->wal.cap;
+    *n = sh->wal.len;
+    sh->wal.buf = sh->wal.spare;
+    sh->wal.cap = sh->wal.spare_cap;
+    sh->wal.spare = b;
+    sh->wal.spare_cap = c;
+    sh->wal.len = 0;
+    return b;
+}
+
+/* fsync always: return once every record appended so far is durable. Called
+   after the shard locks are let go. The first waiter writes and syncs the
+   buffer for everyone outside lock; the others wait on synced, and records
+   appended meanwhile go out with the next sync
+*/
+static void wal_commit(shortener_t *sh) {
+    if (!sh->wal.active || sh->wal.policy != FSYNC_ALWAYS) return;
+    pthread_mutex_lock(&sh->wal.lock);
+    uint64_t lsn = sh->wal.next_lsn;
+    while (sh->wal.durable_lsn < lsn) {
+        if (sh->wal.syncing) {
+            pthread_cond_wait(&sh->wal.synced, &sh->wal.lock);
+            continue;
+        }
+        sh->wal.syncing = 1;
+        size_t n;
+        char *b = wal_take(sh, &n);
+        uint64_t upto = sh->wal.next_lsn;
+        pthread_mutex_unlock(&sh->wal.lock);
+        // also syncs records a compaction or rebase wrote out unsynced
+        if (n) wal_write_all(sh, b, n);
+        wal_sync(sh);
+        pthread_mutex_unlock(&sh->wal.io);
+        pthread_mutex_lock(&sh->wal.lock);
+        sh->wal.durable_lsn = upto;
+        sh->wal.syncing = 0;
+        sh->wal.syncs++;
+        pthread_cond_broadcast(&sh->wal.synced);
+    }
+    pthread_mutex_unlock(&sh->wal.lock);
+}
+
+/* A block leased up to end is durable before the caller uses it, so replay
+   never hands its sequence numbers out again
+*/
+static void wal_log_lease(shortener_t *sh, uint64_t end) {
+    if (!sh->wal.active) return;
+    uint8_t rec[WAL_RECORD_MAX];
+    size_t n = 0;
+    rec[n++] = WAL_LEASE;
+    n += varint_put(rec + n, end);
+    if (sh->wal.policy == FSYNC_ALWAYS) {
+        // rare enough (once per LEASE_BLOCK) to wait with the shard locks held
+        wal_append(sh, rec, wal_seal(rec, n));
+        wal_commit(sh);
+        return;
+    }
+    // holding io keeps the group flusher from writing meanwhile
+    if (sh->wal.policy == FSYNC_GROUP) pthread_mutex_lock(&sh->wal.io);
+    wal_append(sh, rec, wal_seal(rec, n));
+    pthread_mutex_lock(&sh->wal.lock);
+    wal_flush(sh, 1);
+    pthread_mutex_unlock(&sh->wal.lock);
+    if (sh->wal.policy == FSYNC_GROUP) pthread_mutex_unlock(&sh->wal.io);
+}
+
+// Group commit: every group_ms, take the filled buffer and write + sync it unlocked
+static void *wal_flusher(void *arg) {
+    shortener_t *sh = arg;
+    pthread_mutex_lock(&sh->wal.lock);
+    while (!sh->wal.stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += sh->wal.group_ms % 1000 * 1000000;
+        deadline.tv_sec += sh->wal.group_ms / 1000 + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&sh->wal.wake, &sh->wal.lock, &deadline);
+        if (!sh->wal.len) continue;
+        size_t n;
+        char *b = wal_take(sh, &n);
+        pthread_mutex_unlock(&sh->wal.lock);
+        if (n) {
+            wal_write_all(sh, b, n);
+            wal_sync(sh);
+        }
+        pthread_mutex_unlock(&sh->wal.io);
+        pthread_mutex_lock(&sh->wal.lock);
+        if (n) sh->wal.syncs++;
+    }
+    pthread_mutex_unlock(&sh->wal.lock);
+    return NULL;
+}
+
+// Exclusive use of the log file and buffer, against the group flusher and appending writers
+static void wal_lock_all(shortener_t *sh) {
+    pthread_mutex_lock(&sh->wal.io);
+    pthread_mutex_lock(&sh->wal.lock);
+}
+
+static void wal_unlock_all(shortener_t *sh) {
+    pthread_mutex_unlock(&sh->wal.lock);
+    pthread_mutex_unlock(&sh->wal.io);
+}
+
+static size_t wal_header(uint8_t *header, uint64_t lsn) {
+    memcpy(header, WAL_MAGIC, 8);
+    for (int i = 0; i < 8; ++i) header[8 + i] = (uint8_t)(lsn >> (8 * i));
+    return WAL_HEADER_BYTES;
+}
+
+// Append the log's bytes from offset on to fd; returns the offset reached
+static off_t wal_copy_tail(shortener_t *sh, int fd, off_t offset) {
+    char chunk[64 * 1024];
+    for (ssize_t r; (r = pread(sh->wal.fd, chunk, sizeof(chunk), offset)) != 0; offset += r) {
+        if (r < 0) {
+            if (errno == EINTR) {
+                r = 0;
+                continue;
+            }
+            perror(sh->wal.path);
+            exit(1);
+        }
+        wal_write_fd(fd, chunk, (size_t)r);
+    }
+    return offset;
+}
+
+/* With the log held and flushed: finish the new log fd (at tmp, starting at
+   LSN lsn) with the records from offset on, sync it and rename it over the
+   log, which is reopened for appending.
+*/
+static void wal_replace(shortener_t *sh, int fd, const char *tmp, off_t offset, uint64_t lsn) {
+    wal_copy_tail(sh, fd, offset);
+    wal_sync_fd(fd);
+    if (rename(tmp, sh->wal.path) != 0) {
+        perror(sh->wal.path);
+        exit(1);
+    }
+    sh->wal.file_bytes = (uint64_t)lseek(fd, 0, SEEK_END);
+    close(fd);
+    close(sh->wal.fd);
+    sh->wal.fd = open(sh->wal.path, O_RDWR | O_APPEND);
+    if (sh->wal.fd < 0) {
+        perror(sh->wal.path);
+        exit(1);
+    }
+    sh->wal.base_lsn = lsn;
+}
+
+/* Replace the log with one starting at LSN lsn: a new header followed by the
+   bytes from offset on (records appended since lsn), written to path.tmp,
+   synced and renamed over the log. Everything before offset is covered by a
+   snapshot and dropped.
+*/
+static void wal_rebase(shortener_t *sh, uint64_t lsn, off_t offset) {
+    wal_lock_all(sh);
+    wal_flush(sh, 0);
+    char tmp[LONG_URL_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", sh->wal.path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(tmp);
+        exit(1);
+    }
+    uint8_t header[WAL_HEADER_BYTES];
+    wal_write_fd(fd, (const char *)header, wal_header(header, lsn));
+    wal_replace(sh, fd, tmp, offset, lsn);
+    wal_unlock_all(sh);
+}
+
+// Between commands: the os policy hands buffered records to the kernel
+static void wal_idle(shortener_t *sh) {
+    if (sh->wal.active && sh->wal.policy == FSYNC_OS) wal_flush(sh, 0);
+}
+
+// Stop the flusher, then write and sync whatever is left
+static void wal_close(shortener_t *sh) {
+    if (sh->wal.fd < 0) return;
+    if (sh->wal.active && sh->wal.policy == FSYNC_GROUP) {
+        pthread_mutex_lock(&sh->wal.lock);
+        sh->wal.stopping = 1;
+        pthread_cond_signal(&sh->wal.wake);
+        pthread_mutex_unlock(&sh->wal.lock);
+        pthread_join(sh->wal.flusher, NULL);
+    }
+    wal_flush(sh, sh->wal.policy != FSYNC_OS);
+    close(sh->wal.fd);
+    free(sh->wal.buf);
+    free(sh->wal.spare);
+    sh->wal.fd = -1;
+    sh->wal.active = 0;
+    sh->wal.buf = sh->wal.spare = NULL;
+    sh->wal.len = sh->wal.cap = sh->wal.spare_cap = 0;
+}
+
+/* encode integer id (below CODE_SPACE) to base62 fixed-length short code.
+   One 128-bit reciprocal multiply splits it at 62^4 into its top three and
+   bottom four digits, and each half (below 2^24) is peeled with 32-bit
+   reciprocal multiplies: two short dependency chains instead of seven
+   64-bit divisions in a row. Both constants are exact over those ranges.
+*/
+_Static_assert(SHORT_CODE_LEN == 7, "the digit split assumes 7-digit codes");
+static inline void id_to_base62(uint64_t id, char *out) {
+    uint32_t hi = (uint32_t)(((unsigned __int128)id * 0x48aa9357eb1ULL) >> 66); // id / 62^4
+    uint32_t lo = (uint32_t)(id - (uint64_t)hi * 14776336);
+    for (int i = SHORT_CODE_LEN - 1; i >= 3; --i) {
+        uint32_t q = (uint32_t)(((uint64_t)lo * 0x1084211) >> 30); // lo / 62
+        out[i] = BASE62[lo - q * 62];
+        lo = q;
+    }
+    for (int i = 2; i >= 0; --i) {
+        uint32_t q = (uint32_t)(((uint64_t)hi * 0x1084211) >> 30);
+        out[i] = BASE62[hi - q * 62];
+        hi = q;
+    }
+}
+
+/* decode a fixed-length base62 short code back to its integer.
+   Returns 0 if the code has the wrong length or a character outside BASE62.
+*/
+static int base62_to_id(const char *code, size_t len, uint64_t *out) {
+    if (len != SHORT_CODE_LEN) return 0;
+    uint64_t id = 0;
+    for (int i = 0; i < SHORT_CODE_LEN; ++i) {
+        unsigned char c = (unsigned char)code[i];
+        int d;
+        if (c >= '0' && c <= '9') d = c - '0';
+        else if (c >= 'a' && c <= 'z') d = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'Z') d = c - 'A' + 36;
+        else return 0;
+        id = id * 62 + (uint64_t)d;
+    }
+    *out = id;
+    return 1;
+}
+
+/* Lock-free lookups (shortener_get, and dedup checks against a shard the
+   caller has not locked). Each load a lookup makes may race with a write
+   section of the shard, so each value that is about to be followed as a
+   pointer or used as an index is first checked with read_valid; a failed
+   check returns READ_AGAIN and the lookup starts over at a new count.
+*/
+#define READ_AGAIN (-2)
+// whatever the bytes it decodes, a decode writes at most 8 bytes per coded byte
+#define READ_BUF_BYTES (HOST_PREFIX_MAX + 8 * (LONG_URL_MAX + 4) + SYM_DECODE_SLACK)
+
+// The live node for code at count s into *out (NULL if none); 0 to start over
+static int read_find(const Shard *sd, uint64_t code, unsigned s, const Node **out) {
+#if defined(SHORT_INDEX_SWISS)
+    const int8_t *ctrl = LOAD_PUBLISHED(sd->short_index.ctrl);
+    Node *const *slots = LOAD_PUBLISHED(sd->short_index.slots);
+    size_t capacity = LOAD_SHARED(sd->short_index.capacity);
+    if (!read_valid(sd, s)) return 0;
+    uint64_t h = swiss_hash(code);
+    size_t mask = capacity - 1;
+    size_t pos = SWISS_H1(h) & mask;
+    int8_t h2 = SWISS_H2(h);
+    for (size_t step = GROUP_WIDTH;; step += GROUP_WIDTH) {
+        int8_t g[GROUP_WIDTH];
+        load_shared_bytes((char *)g, (const char *)ctrl + pos, GROUP_WIDTH);
+        for (uint32_t m = group_match(g, h2); m; m &= m - 1) {
+            const Node *n = LOAD_SHARED(slots[(pos + __builtin_ctz(m)) & mask]);
+            if (!read_valid(sd, s)) return 0;
+            if (n && LOAD_SHARED(n->code) == code) {
+                *out = n;
+                return 1;
+            }
+        }
+        if (group_match_empty(g)) break;
+        // a probe run torn by a write could lack the empty group that ends it
+        if (!read_valid(sd, s)) return 0;
+        pos = (pos + step) & mask;
+    }
+    *out = NULL;
+    return 1;
+#elif defined(SHORT_INDEX_DENSE)
+    *out = NULL;
+    if (code >= ALIAS_CODE_MIN) return 1;
+    uint64_t seq = unscramble_id(code) >> sd->sh->shard_bits;
+    Node **dir2 = LOAD_PUBLISHED(sd->short_index.dir[seq >> (DENSE_SLOT_BITS + DENSE_DIR2_BITS)]);
+    if (!read_valid(sd, s)) return 0;
+    if (!dir2) return 1;
+    Node *seg = LOAD_PUBLISHED(dir2[(seq >> DENSE_SLOT_BITS) & DENSE_DIR2_MASK]);
+    if (!read_valid(sd, s)) return 0;
+    if (!seg) return 1;
+    Node *n = &seg[seq & (DENSE_SEG_NODES - 1)];
+    Node h;
+    h.url_word = LOAD_SHARED(n->url_word);
+    if (h.url_flags & URL_LIVE) *out = n;
+    return 1;
+#else
+    // only what head_for looks at
+    HashTable t;
+    t.buckets = LOAD_PUBLISHED(sd->short_table.buckets);
+    t.size = LOAD_SHARED(sd->short_table.size);
+    t.old_buckets = LOAD_SHARED(sd->short_table.old_buckets);
+    t.old_size = LOAD_SHARED(sd->short_table.old_size);
+    t.rehash_pos = LOAD_SHARED(sd->short_table.rehash_pos);
+    if (!read_valid(sd, s)) return 0;
+    const Node *cur = LOAD_SHARED(*head_for(&t, hash_code(code)));
+    for (;;) {
+        if (!read_valid(sd, s)) return 0;
+        if (!cur || LOAD_SHARED(cur->code) == code) break;
+        cur = LOAD_SHARED(cur->next_short);
+    }
+    *out = cur;
+    return 1;
+#endif
+}
+
+// Node n's URL into out (READ_BUF_BYTES) at count s; its length, or READ_AGAIN
+static long read_url(const Shard *sd, const Node *n, unsigned s, char *out) {
+    // the stored bytes change in place (train recodes, deletes reuse the node), so work on a copy
+    char bytes[LONG_URL_MAX + 4];
+    Node h;
+    h.url_word = LOAD_SHARED(n->url_word);
+    unsigned flags = h.url_flags;
+    size_t len = h.url_len, stored = h.stored_len;
+    uint32_t seg = LOAD_SHARED(n->url.ref.seg), off = LOAD_SHARED(n->url.ref.off);
+    load_shared_bytes(bytes, n->url.inline_bytes, INLINE_URL_MAX);
+    if (!read_valid(sd, s)) return READ_AGAIN;
+    if (!(flags & URL_INLINE)) {
+        const ArenaSeg *segs = LOAD_PUBLISHED(sd->url_arena.segs);
+        if (!read_valid(sd, s)) return READ_AGAIN;
+        const char *data = LOAD_SHARED(segs[seg].data);
+        if (!read_valid(sd, s)) return READ_AGAIN;
+        load_shared_bytes(bytes, data + off, stored);
+    }
+    size_t k = 0, o = 0;
+    if (flags & URL_HOSTDICT) {
+        uint64_t id = 0;
+        do {
+            id |= (uint64_t)(bytes[k] & 0x7f) << (7 * k);
+        } while ((bytes[k++] & 0x80) && k < stored);
+        const HostEntry *entries = LOAD_PUBLISHED(sd->host_dict.entries);
+        if (!read_valid(sd, s)) return READ_AGAIN;
+        const char *prefix = LOAD_PUBLISHED(entries[id].prefix);
+        o = LOAD_SHARED(entries[id].len);
+        if (!read_valid(sd, s)) return READ_AGAIN;
+        memcpy(out, prefix, o);
+    }
+    if (flags & URL_SYMBOLS) {
+        const SymbolTable *t = LOAD_PUBLISHED(sd->url_symbols);
+        if (!read_valid(sd, s)) return READ_AGAIN;
+        sym_decode(t, (const uint8_t *)bytes + k, stored - k, out + o);
+    } else {
+        memcpy(out + o, bytes + k, stored - k);
+    }
+    return (long)len;
+}
+
+/* The snapshot's URL for code into out at count s of the code's shard sd;
+   its length, -1, or READ_AGAIN
+*/
+static long read_snap(const shortener_t *sh, const Shard *sd, uint64_t code, unsigned s, char *out) {
+    // the rest of the mapping's description is set once, before any lookup
+    const Snapshot *snap = &sh->snap;
+    const uint8_t *map = LOAD_SHARED(snap->map), *gone = LOAD_SHARED(snap->gone);
+    if (!read_valid(sd, s)) return READ_AGAIN;
+    if (!map) return -1;
+    size_t lo = 0, hi = snap->hdr->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (snap->entries[mid].code < code) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == snap->hdr->count || snap->entries[lo].code != code ||
+        (__atomic_load_n(&gone[lo >> 3], __ATOMIC_RELAXED) & (1 << (lo & 7))))
+        return -1;
+    size_t len = (size_t)(snap->entries[lo].off_len & 0xffff);
+    if (len >= LONG_URL_MAX) return -1;
+    memcpy(out, snap->blob + (snap->entries[lo].off_len >> 16), len);
+    return (long)len;
+}
+
+/* Whether the node for code, in a shard sd the caller has not locked (or
+   has no write section open on), holds the key's URL: it is read the way a
+   lookup reads it and compared whole.
+*/
+static int url_matches_shared(const Shard *sd, uint64_t code, const UrlKey *k) {
+    char buf[READ_BUF_BYTES];
+    ReaderRecord *r = reader_record();
+    reader_enter(r);
+    long l;
+    for (;;) {
+        unsigned s = read_begin(sd);
+        const Node *n;
+        if (!read_find(sd, code, s, &n)) l = READ_AGAIN;
+        else l = n ? read_url(sd, n, s, buf) : -1;
+        if (l != READ_AGAIN && read_valid(sd, s)) break;
+    }
+    reader_exit(r);
+    return l == (long)k->len && memcmp(buf, k->url, k->len) == 0;
+}
+
+// find node by decoded short code in its shard (traverse short_table via next_short) 
+static Node *find_by_code(Shard *sd, uint64_t code) {
+#if defined(SHORT_INDEX_SWISS)
+    return swiss_find(&sd->short_index, code);
+#elif defined(SHORT_INDEX_DENSE)
+    // only generated codes have a sequence number, and so a slot
+    if (code >= ALIAS_CODE_MIN) return NULL;
+    Node *n = dense_slot(&sd->short_index, unscramble_id(code) >> sd->sh->shard_bits);
+    return n && (n->url_flags & URL_LIVE) ? n : NULL;
+#else
+    if (table_rehashing(&sd->short_table)) table_rehash_step(sd, &sd->short_table, sd->sh->rehash_step);
+    Node *cur = *head_for(&sd->short_table, hash_code(code));
+    while (cur) {
+        if (cur->code == code) return cur;
+        cur = cur->next_short;
+    }
+    return NULL;
+#endif
+}
+
+/* Whether the mapping for code (node n, or NULL to look it up), found in
+   the long-URL index of l, is the key's URL. A node of l itself is compared
+   in stored form; one of another shard, whose dictionary and symbols the key
+   was not prepared for, is read back and compared whole.
+*/
+static int code_url_matches(Shard *l, uint64_t code, Node *n, UrlKey *key) {
+    Shard *owner = shard_of_code(l->sh, code);
+    if (owner != l) return url_matches_shared(owner, code, key);
+    if (!n) n = find_by_code(l, code);
+    return n && n->url_len == key->len && node_url_matches(l, n, key);
+}
+
+#ifdef LONG_INDEX_FINGERPRINT
+/* find the code for a long url in its shard l: one Robin Hood probe run over
+   the fingerprint index; the node is only looked up and compared when the
+   fingerprint matches. Returns 1 with the code in *code if the URL is stored.
+*/
+static int find_by_long_key(Shard *l, UrlKey *key, uint64_t *code) {
+    FpIndex *f = &l->long_index;
+    size_t mask = f->capacity - 1;
+    uint64_t hi = fp_hi(key->hash), tag = fp_tag(key->fp_lo);
+    size_t pos = fp_home(f, hi);
+    for (size_t dist = 0;; pos = (pos + 1) & mask, ++dist) {
+        const FpEntry *s = &f->slots[pos];
+        if (!s->hi || fp_dist(f, pos) < dist) return 0;
+        if (s->hi != hi || fp_tag(s->tag_code) != tag) continue;
+        uint64_t c = s->tag_code & FP_CODE_MASK;
+        if (code_url_matches(l, c, NULL, key)) {
+            *code = c;
+            return 1;
+        }
+    }
+}
+#else
+/* find the code for a long url in its shard l (traverse long_table via
+   next_long); the URL is only compared once the hash matches. Returns 1
+   with the code in *code if the URL is stored.
+*/
+static int find_by_long_key(Shard *l, UrlKey *key, uint64_t *code) {
+    if (table_rehashing(&l->long_table)) table_rehash_step(l, &l->long_table, l->sh->rehash_step);
+    for (Node *cur = *head_for(&l->long_table, key->hash); cur; cur = cur->next_long) {
+        if (cur->url_hash == key->hash && code_url_matches(l, cur->code, cur, key)) {
+            *code = cur->code;
+            return 1;
+        }
+    }
+    return 0;
+}
+#endif
+
+
+/* Insert a new node into both indexes (node allocated once), reusing the
+   key's hashes. s is the code's shard, which gets the node, and l the URL's;
+   both are held.
+*/
+static void store_mapping(Shard *s, Shard *l, uint64_t code, const UrlKey *key) {
+    write_begin(s);
+#ifdef SHORT_INDEX_DENSE
+    // the slot itself is the node; it is occupied once URL_LIVE is set
+    Node *node = dense_claim(&s->short_index, unscramble_id(code) >> s->sh->shard_bits);
+#else
+    Node *node = slab_alloc(&s->node_slab);
+#endif
+    STORE_SHARED(node->code, code);
+    arena_compact_step(s, &s->url_arena, COMPACT_STEP);
+    node_set_url(s, node, key->url, key->len);
+    node->url_hash = key->hash;
+
+#if defined(SHORT_INDEX_SWISS)
+    swiss_insert(s, &s->short_index, node);
+#elif defined(SHORT_INDEX_DENSE)
+    s->short_index.count++;
+#else
+    // insert into short_table (head insertion) 
+    Node **hs = head_for(&s->short_table, hash_code(code));
+    STORE_SHARED(node->next_short, *hs);
+    STORE_SHARED(*hs, node);
+    s->short_table.count++;
+    table_check_load(s, &s->short_table);
+#endif
+
+#ifdef LONG_INDEX_FINGERPRINT
+    fp_insert(&l->long_index, key->hash, key->fp_lo, code);
+#else
+    // insert into long_table (head insertion) 
+    Node **hl = head_for(&l->long_table, key->hash);
+    node->next_long = *hl;
+    *hl = node;
+    l->long_table.count++;
+    table_check_load(l, &l->long_table);
+#endif
+    write_end(s);
+}
+
+// Log a new mapping, then store it
+static void insert_mapping_key(shortener_t *sh, Shard *s, Shard *l, uint64_t code, const UrlKey *key) {
+    wal_log_insert(sh, code, key->url, key->len);
+    store_mapping(s, l, code, key);
+}
+
+
+// Unlink node from its shard's short_table chain given exact node pointer 
+static int unlink_from_short_table(Shard *s, Node *node) {
+    if (!node) return 0;
+#if defined(SHORT_INDEX_SWISS)
+    return swiss_erase(s, &s->short_index, node);
+#elif defined(SHORT_INDEX_DENSE)
+    // the slot stays where it is; release_node marks it empty
+    s->short_index.count--;
+    return 1;
+#else
+    Node **hs = head_for(&s->short_table, hash_code(node->code));
+    Node *cur = *hs;
+    Node *prev = NULL;
+    while (cur) {
+        if (cur == node) {
+            if (prev) STORE_SHARED(prev->next_short, cur->next_short);
+            else STORE_SHARED(*hs, cur->next_short);
+            s->short_table.count--;
+            table_check_load(s, &s->short_table);
+            return 1;
+        }
+        prev = cur;
+        cur = cur->next_short;
+    }
+    return 0;
+#endif
+}
+
+// Unlink node from its URL shard's long_table chain given exact node pointer 
+static int unlink_from_long_table(Shard *l, Node *node) {
+    if (!node) return 0;
+#ifdef LONG_INDEX_FINGERPRINT
+    return fp_erase(&l->long_index, node->url_hash, node->code);
+#else
+    Node **hl = head_for(&l->long_table, node->url_hash);
+    Node *cur = *hl;
+    Node *prev = NULL;
+    while (cur) {
+        if (cur == node) {
+            if (prev) prev->next_long = cur->next_long;
+            else *hl = cur->next_long;
+            l->long_table.count--;
+            table_check_load(l, &l->long_table);
+            return 1;
+        }
+        prev = cur;
+        cur = cur->next_long;
+    }
+    return 0;
+#endif
+}
+
+// Free a node's payload and hand its storage back to its shard
+static void release_node(Shard *s, Node *node) {
+    node_clear_url(s, node);
+#ifndef SHORT_INDEX_DENSE
+    slab_free(&s->node_slab, node);
+#endif
+    arena_maybe_compact(s, &s->url_arena);
+    arena_compact_step(s, &s->url_arena, COMPACT_STEP);
+}
+
+// Log the delete, unlink from both indexes (shards s and l, held), then free payload and node 
+static void remove_node(shortener_t *sh, Shard *s, Shard *l, Node *node) {
+    wal_log_delete(sh, node->code);
+    write_begin(s);
+    unlink_from_short_table(s, node);
+    unlink_from_long_table(l, node);
+    release_node(s, node);
+    write_end(s);
+}
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Snapshot (--snapshot PATH, written by "save"): a file laid out to be mmap'ed
+   and served as is, so a restart answers requests before anything is loaded.
+     SnapHeader
+     SnapEntry[count]      sorted by code: binary search answers get
+     URL blob              raw URL bytes
+     uint32_t[index_slots] open-addressed URL index (entry + 1, 0 = empty),
+                           keyed by hash_bytes(url, url_seed)
+   Entries deleted since, or already moved into the tables, are marked in the
+   'gone' bitmap. Between commands, warm-up moves SNAP_WARM_STEP entries at a
+   time into the tables; once all are moved the map is dropped. The header
+   records the WAL LSN the snapshot covers, so replay starts from there.
+*/
+
+// Bits of different entries share a byte, and so may be set from different shards at once
+static inline int snap_gone(shortener_t *sh, size_t i) {
+    return __atomic_load_n(&sh->snap.gone[i >> 3], __ATOMIC_RELAXED) & (1 << (i & 7));
+}
+
+// The caller holds the shard of the entry's code
+static void snap_set_gone(shortener_t *sh, size_t i) {
+    Shard *sd = shard_of_code(sh, sh->snap.entries[i].code);
+    write_begin(sd);
+    __atomic_fetch_or(&sh->snap.gone[i >> 3], (uint8_t)(1 << (i & 7)), __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&sh->snap.live, 1, __ATOMIC_RELAXED);
+    write_end(sd);
+}
+
+static inline const char *snap_url(shortener_t *sh, size_t i, size_t *len) {
+    *len = (size_t)(sh->snap.entries[i].off_len & 0xffff);
+    return sh->snap.blob + (sh->snap.entries[i].off_len >> 16);
+}
+
+// Entry still served from the snapshot for code, or -1
+static long snap_find_code(shortener_t *sh, uint64_t code) {
+    if (!sh->snap.map) return -1;
+    size_t lo = 0, hi = sh->snap.hdr->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (sh->snap.entries[mid].code < code) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo < sh->snap.hdr->count && sh->snap.entries[lo].code == code && !snap_gone(sh, lo)) return (long)lo;
+    return -1;
+}
+
+// Entry still served from the snapshot for url, or -1
+static long snap_find_url(shortener_t *sh, const char *url, size_t len) {
+    if (!sh->snap.map) return -1;
+    size_t mask = sh->snap.hdr->index_slots - 1;
+    for (size_t pos = hash_bytes(url, len, sh->snap.hdr->url_seed) & mask;; pos = (pos + 1) & mask) {
+        uint32_t e = sh->snap.index[pos];
+        if (!e) return -1;
+        size_t l;
+        const char *u = snap_url(sh, e - 1, &l);
+        if (l == len && memcmp(u, url, len) == 0) return snap_gone(sh, e - 1) ? -1 : (long)(e - 1);
+    }
+}
+
+// Every shard is held (lookups of any code may be reading the map)
+static void snap_close(shortener_t *sh) {
+    if (!sh->snap.map) return;
+    write_begin_all(sh);
+    retire(&sh->shards[0], sh->snap.map, sh->snap.map_bytes, release_unmap);
+    retire(&sh->shards[0], sh->snap.gone, 0, release_free);
+    STORE_SHARED(sh->snap.map, NULL);
+    STORE_SHARED(sh->snap.gone, NULL);
+    sh->snap.live = 0;
+    write_end_all(sh);
+}
+
+// Move up to n more entries into the tables, with every shard held; returns 1 while some remain
+static int snap_warm_step(shortener_t *sh, size_t n) {
+    if (!sh->snap.map) return 0;
+    while (n && sh->snap.warm_pos < sh->snap.hdr->count) {
+        size_t i = sh->snap.warm_pos++;
+        if (snap_gone(sh, i)) continue;
+        size_t len;
+        const char *u = snap_url(sh, i, &len);
+        UrlKey key;
+        url_key_init(&key, u, len);
+        uint64_t code = sh->snap.entries[i].code;
+        store_mapping(shard_of_code(sh, code), shard_of_url(sh, key.hash), code, &key);
+        snap_set_gone(sh, i);
+        n--;
+    }
+    if (sh->snap.warm_pos < sh->snap.hdr->count) return 1;
+    snap_close(sh);
+    return 0;
+}
+
+static void snap_warm_idle(shortener_t *sh, long budget_us) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (snap_warm_step(sh, SNAP_WARM_STEP)) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long us = (now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000;
+        if (us >= budget_us) break;
+    }
+}
+
+/* Map the snapshot at path, if there is one. Only the header is checked and
+   the bitmap allocated; pages are faulted in as requests touch them.
+   Returns the number of entries, 0 when there is no snapshot yet.
+*/
+static size_t snap_open(shortener_t *sh, const char *path) {
+    sh->snap.path = path;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) return 0;
+        perror(path);
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror(path);
+        exit(1);
+    }
+    size_t size = (size_t)st.st_size;
+    uint8_t *map = size >= sizeof(SnapHeader) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    const SnapHeader *h = (const SnapHeader *)map;
+    if (map == MAP_FAILED || memcmp(h->magic, SNAP_MAGIC, 8) != 0 || h->count >= UINT32_MAX ||
+        h->index_slots <= h->count || (h->index_slots & (h->index_slots - 1)) ||
+        size != sizeof(SnapHeader) + h->count * sizeof(SnapEntry) + ((h->blob_bytes + 7) & ~7ULL) +
+                h->index_slots * sizeof(uint32_t)) {
+        fprintf(stderr, "%s: not a valid snapshot\n", path);
+        exit(1);
+    }
+    sh->snap.map = map;
+    sh->snap.map_bytes = size;
+    sh->snap.hdr = h;
+    sh->snap.entries = (const SnapEntry *)(map + sizeof(SnapHeader));
+    sh->snap.blob = (const char *)(sh->snap.entries + h->count);
+    sh->snap.index = (const uint32_t *)(sh->snap.blob + ((h->blob_bytes + 7) & ~7ULL));
+    sh->snap.gone = calloc(h->count / 8 + 1, 1);
+    if (!sh->snap.gone) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    sh->snap.live = h->count;
+    sh->snap.warm_pos = 0;
+    if (h->global_id > sh->global_id) sh->global_id = h->global_id;
+    // an older snapshot does not say: count all it leased as used
+    uint64_t used = h->used_end ? h->used_end : h->global_id;
+    if (used > sh->used_end) sh->used_end = used;
+    madvise(map, size, MADV_RANDOM);
+    return h->count;
+}
+
+typedef struct SnapItem {
+    uint64_t code;
+    Node *node;
+} SnapItem;
+
+static int cmp_snap_item(const void *a, const void *b) {
+    const SnapItem *x = a, *y = b;
+    return x->code < y->code ? -1 : x->code > y->code;
+}
+
+static void snap_write(FILE *f, const void *p, size_t n, const char *path) {
+    if (fwrite(p, 1, n, f) != n) {
+        perror(path);
+        exit(1);
+    }
+}
+
+#define SNAP_PROGRESS_STEP 65536
+
+// One past the highest sequence number handed out (every shard locked); a shard's lease_next is past all of its own
+static uint64_t ids_used_end(const shortener_t *sh) {
+    uint64_t end = sh->used_end;
+    for (unsigned i = 0; i < sh->shard_count; ++i)
+        if (sh->shards[i].lease_next > end) end = sh->shards[i].lease_next;
+    return end;
+}
+
+/* Write every mapping to a snapshot at path, with every shard held: into
+   path.tmp, synced, then renamed over the old one, so a crash leaves either
+   snapshot intact. Any
+   snapshot still being served is first moved into the tables. progress, if
+   given, is told how many URLs are written every SNAP_PROGRESS_STEP and at
+   the end. Returns the number of mappings written, or -1 if the file cannot
+   be created.
+*/
+static long snap_save(shortener_t *sh, const char *path, void (*progress)(shortener_t *sh, size_t done, size_t total)) {
+    while (snap_warm_step(sh, SIZE_MAX))
+        ;
+    size_t count = mapping_count(sh);
+    SnapItem *items = malloc((count ? count : 1) * sizeof(SnapItem));
+    size_t slots = 16;
+    while (slots < count * 2) slots <<= 1;
+    uint32_t *index = calloc(slots, sizeof(uint32_t));
+    if (!items || !index) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    NodeCursor c;
+    cursor_start(&c, sh->shards, sh->shards + sh->shard_count);
+    size_t n = 0;
+    for (Node *node; (node = cursor_next(&c));) items[n++] = (SnapItem){ node->code, node };
+    qsort(items, n, sizeof(SnapItem), cmp_snap_item);
+
+    char tmp[LONG_URL_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) {
+        perror(tmp);
+        free(items);
+        free(index);
+        return -1;
+    }
+    SnapHeader h = { .count = n, .global_id = sh->global_id, .url_seed = hash_seed, .index_slots = slots };
+    memcpy(h.magic, SNAP_MAGIC, 8);
+    h.next_lsn = sh->wal.active ? sh->wal.next_lsn : 0;
+    h.used_end = ids_used_end(sh);
+    for (size_t i = 0; i < n; ++i) h.blob_bytes += items[i].node->url_len;
+    snap_write(f, &h, sizeof(h), tmp);
+
+    uint64_t off = 0;
+    for (size_t i = 0; i < n; ++i) {
+        SnapEntry e = { items[i].code, off << 16 | items[i].node->url_len };
+        snap_write(f, &e, sizeof(e), tmp);
+        off += items[i].node->url_len;
+    }
+    char url[LONG_URL_MAX + SYM_DECODE_SLACK];
+    for (size_t i = 0; i < n; ++i) {
+        size_t len = node_read_url(shard_of_code(sh, items[i].code), items[i].node, url);
+        snap_write(f, url, len, tmp);
+        size_t pos = hash_bytes(url, len, hash_seed) & (slots - 1);
+        while (index[pos]) pos = (pos + 1) & (slots - 1);
+        index[pos] = (uint32_t)(i + 1);
+        if (progress && (i + 1) % SNAP_PROGRESS_STEP == 0) progress(sh, i + 1, n);
+    }
+    static const char pad[8];
+    snap_write(f, pad, ((h.blob_bytes + 7) & ~7ULL) - h.blob_bytes, tmp);
+    snap_write(f, index, slots * sizeof(uint32_t), tmp);
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0 || fclose(f) != 0 || rename(tmp, path) != 0) {
+        perror(path);
+        exit(1);
+    }
+    free(items);
+    free(index);
+    if (progress) progress(sh, n, n);
+    return (long)n;
+}
+
+/* Log compaction ("compact", or on its own once the log outgrows the live set
+   WAL_COMPACT_RATIO times over): rewrite the log as an image of the live
+   mappings, dropping deleted ones. "compact" does nothing when the image
+   would be no smaller than the log is already.
+
+   The LSN the log has reached is noted as the start, then the walk streams
+   the live set into path.compact in steps of LOG_COMPACT_STEP mappings, each
+   under the shard locks, so writers are never held up for more than one
+   step. Records go into a large buffer that a writer thread writes out
+   sequentially while the walk fills the other one; handing a full one over
+   waits for the writer with no shard lock held. Mappings created or deleted
+   during the walk are in the log after the start LSN, which is copied over
+   behind the image: most of it unlocked while the log keeps growing, the
+   last few records with the log (not the shards) held. The new file is synced and renamed over
+   the log. Replay applies the image first; records repeated in both are
+   harmless because replay is idempotent.
+
+   Snapshot entries still served from the file are imaged too, before the
+   nodes: warm-up may move an entry into any node slot, but only into one the
+   node walk has not started on yet. The image has to stand on its own: it
+   starts past the snapshot's LSN, so the DELETEs of snapshot entries are not
+   in it, and replay uses it in place of the snapshot rather than on top of
+   it. With a snapshot configured, save (which rebases the log onto the new
+   snapshot) is what shrinks the log without copying the snapshot into it. A save supersedes a running compaction and
+   cancels it. Between steps the compaction belongs to whoever holds
+   sh->maint.
+*/
+
+static void *log_compact_writer(void *arg) {
+    LogCompaction *c = arg;
+    pthread_mutex_lock(&c->lock);
+    for (;;) {
+        while (!c->out_len && !c->stopping) pthread_cond_wait(&c->cond, &c->lock);
+        if (!c->out_len) break;
+        size_t n = c->out_len;
+        pthread_mutex_unlock(&c->lock);
+        wal_write_fd(c->fd, c->out, n);
+        pthread_mutex_lock(&c->lock);
+        c->out_len = 0;
+        c->written += n;
+        pthread_cond_broadcast(&c->cond);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+// Pass the filled buffer to the writer, once it is done with the previous one
+static void log_compact_handoff(LogCompaction *c) {
+    pthread_mutex_lock(&c->lock);
+    while (c->out_len) pthread_cond_wait(&c->cond, &c->lock);
+    char *b = c->out;
+    c->out = c->fill;
+    c->out_len = c->fill_len;
+    c->fill = b;
+    c->fill_len = 0;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+}
+
+// Write out what is left and stop the writer
+static void log_compact_stop_writer(LogCompaction *c) {
+    if (c->fill_len) log_compact_handoff(c);
+    pthread_mutex_lock(&c->lock);
+    c->stopping = 1;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    pthread_join(c->writer, NULL);
+    free(c->fill);
+    free(c->out);
+    c->fill = c->out = NULL;
+}
+
+// The walk stops a step once the buffer is full, so it never holds more than one record past LOG_COMPACT_BUF
+static void log_compact_image(LogCompaction *c, uint64_t code, const char *url, size_t len) {
+    c->fill_len += wal_encode_mapping((uint8_t *)c->fill + c->fill_len, WAL_IMAGE, code, url, len);
+    c->images++;
+}
+
+// Start compacting the log; returns 0 if there is none or it is already running
+static int log_compact_start(shortener_t *sh) {
+    LogCompaction *c = &sh->log_compaction;
+    if (!sh->wal.active || c->running) return 0;
+    snprintf(c->tmp, sizeof(c->tmp), "%s.compact", sh->wal.path);
+    c->fd = open(c->tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (c->fd < 0) {
+        perror(c->tmp);
+        return 0;
+    }
+    c->fill = malloc(LOG_COMPACT_BUF + WAL_RECORD_MAX);
+    c->out = malloc(LOG_COMPACT_BUF + WAL_RECORD_MAX);
+    if (!c->fill || !c->out) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    wal_lock_all(sh);
+    wal_flush(sh, 0);
+    c->start_lsn = sh->wal.next_lsn;
+    c->start_offset = lseek(sh->wal.fd, 0, SEEK_END);
+    wal_unlock_all(sh);
+
+    uint8_t *p = (uint8_t *)c->fill;
+    size_t n = wal_header(p, c->start_lsn);
+    uint8_t *rec = p + n;
+    size_t k = 0;
+    rec[k++] = WAL_SEQ;
+    k += varint_put(rec + k, sh->global_id);
+    c->fill_len = n + wal_seal(rec, k);
+    c->out_len = 0;
+    c->stopping = 0;
+    c->written = 0;
+    c->images = 0;
+    c->snap_pos = 0;
+    c->walking_nodes = 0;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    if (pthread_create(&c->writer, NULL, log_compact_writer, c) != 0) {
+        fprintf(stderr, "Cannot start log compaction writer\n");
+        exit(1);
+    }
+    c->started = now_sec();
+    c->running = 1;
+    return 1;
+}
+
+static void log_compact_abort(shortener_t *sh) {
+    LogCompaction *c = &sh->log_compaction;
+    if (!c->running) return;
+    log_compact_stop_writer(c);
+    close(c->fd);
+    unlink(c->tmp);
+    c->fd = -1;
+    c->running = 0;
+}
+
+/* The image is complete (no shard lock held): copy over what the log gained
+   since the start, the bulk of it while appends go on, and swap the new log
+   in with only the log held.
+*/
+static void log_compact_finish(shortener_t *sh, LogCompaction *c) {
+    log_compact_stop_writer(c);
+    off_t offset = wal_copy_tail(sh, c->fd, c->start_offset);
+    wal_sync_fd(c->fd);
+    wal_lock_all(sh);
+    wal_flush(sh, 0);
+    uint64_t before = (uint64_t)lseek(sh->wal.fd, 0, SEEK_END);
+    wal_replace(sh, c->fd, c->tmp, offset, c->start_lsn);
+    c->last_after = sh->wal.file_bytes;
+    wal_unlock_all(sh);
+    c->fd = -1;
+    c->running = 0;
+    c->completed++;
+    c->last_secs = now_sec() - c->started;
+    c->last_before = before;
+}
+
+/* Image up to n more mappings, every shard locked, stopping early once the
+   buffer is full; returns 0 once the walk is done
+*/
+static int log_compact_step(shortener_t *sh, size_t n) {
+    LogCompaction *c = &sh->log_compaction;
+    while (n && c->fill_len < LOG_COMPACT_BUF && !c->walking_nodes) {
+        // warm-up closes the snapshot once every entry has moved into a node
+        if (!sh->snap.map || c->snap_pos >= sh->snap.hdr->count) {
+            c->walking_nodes = 1;
+            cursor_start(&c->cursor, sh->shards, sh->shards + sh->shard_count);
+            break;
+        }
+        size_t i = c->snap_pos++;
+        if (snap_gone(sh, i)) continue;
+        size_t len;
+        const char *u = snap_url(sh, i, &len);
+        log_compact_image(c, sh->snap.entries[i].code, u, len);
+        n--;
+    }
+    char url[LONG_URL_MAX + SYM_DECODE_SLACK];
+    while (n && c->fill_len < LOG_COMPACT_BUF && c->walking_nodes) {
+        Node *node = cursor_next(&c->cursor);
+        if (!node) return 0;
+        log_compact_image(c, node->code, url, node_read_url(c->cursor.shard, node, url));
+        n--;
+    }
+    return 1;
+}
+
+// With sh->maint held and no shard lock: walk in steps that each take the shard locks
+static void log_compact_idle(shortener_t *sh, long budget_us) {
+    LogCompaction *c = &sh->log_compaction;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (c->running) {
+        shards_lock_all(sh);
+        int more = log_compact_step(sh, LOG_COMPACT_STEP);
+        shards_unlock_all(sh);
+        if (c->fill_len >= LOG_COMPACT_BUF) log_compact_handoff(c);
+        if (!more) {
+            log_compact_finish(sh, c);
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long us = (now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000;
+        if (us >= budget_us) break;
+    }
+}
+
+// About how big a compacted log would be; an IMAGE record is the URL plus about 12 bytes of framing
+static uint64_t log_image_bytes(shortener_t *sh) {
+    size_t raw, stored;
+    url_bytes(sh, &raw, &stored);
+    uint64_t image = WAL_HEADER_BYTES + raw + 12 * (uint64_t)(mapping_count(sh) + sh->snap.live);
+    if (sh->snap.map) image += sh->snap.hdr->blob_bytes;
+    return image;
+}
+
+// The log has grown well past what an image of the live set would take
+static int log_compact_due(shortener_t *sh) {
+    if (!sh->wal.active || sh->log_compaction.running) return 0;
+    if (sh->wal.policy == FSYNC_GROUP) pthread_mutex_lock(&sh->wal.lock);
+    uint64_t size = sh->wal.file_bytes;
+    if (sh->wal.policy == FSYNC_GROUP) pthread_mutex_unlock(&sh->wal.lock);
+    return size >= WAL_COMPACT_MIN && size > WAL_COMPACT_RATIO * log_image_bytes(sh);
+}
+
+/* Background save ("bgsave"): fork, and let the child write the snapshot from
+   its copy-on-write image of the tables while the parent keeps serving. The
+   child reports progress over a pipe, which the parent drains between
+   commands. Once the child exits successfully the log is rebased to the LSN
+   the fork happened at, dropping every record the snapshot covers.
+*/
+
+// Child side: never blocks, a full pipe just skips an update
+static void bgsave_report(shortener_t *sh, size_t done, size_t total) {
+    SaveProgress p = { done, total };
+    if (write(sh->bgsave.fd, &p, sizeof(p)) < 0) {
+        // parent not reading fast enough; a later update will do
+    }
+}
+
+/* Start a background save to path. Returns 0 if one is already running or
+   the fork fails.
+*/
+static int bgsave_start(shortener_t *sh, const char *path) {
+    if (sh->bgsave.pid) return 0;
+    log_compact_abort(sh);
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return 0;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    fflush(NULL);
+    // hold the log still so its size matches the LSN handed to the child
+    wal_lock_all(sh);
+    if (sh->wal.active) wal_flush(sh, 0);
+    sh->bgsave.fork_lsn = sh->wal.next_lsn;
+    sh->bgsave.fork_offset = sh->wal.active ? lseek(sh->wal.fd, 0, SEEK_END) : 0;
+    double t0 = now_sec();
+    pid_t pid = fork();
+    if (pid == 0) {
+        // child: only the tables and the snapshot file; never the log
+        close(fds[0]);
+        sh->bgsave.fd = fds[1];
+        _exit(snap_save(sh, path, bgsave_report) < 0 ? 1 : 0);
+    }
+    sh->bgsave.fork_ms = (now_sec() - t0) * 1e3;
+    wal_unlock_all(sh);
+    close(fds[1]);
+    if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        return 0;
+    }
+    sh->bgsave.pid = pid;
+    sh->bgsave.fd = fds[0];
+    sh->bgsave.started = t0;
+    sh->bgsave.progress = (SaveProgress){ 0, mapping_count(sh) + sh->snap.live };
+    return 1;
+}
+
+/* Drain progress updates and reap the child if it is done (waiting for it if
+   block is set). On success the log is rebased past the snapshot.
+*/
+static void bgsave_poll(shortener_t *sh, int block) {
+    if (!sh->bgsave.pid) return;
+    SaveProgress p;
+    while (read(sh->bgsave.fd, &p, sizeof(p)) == sizeof(p)) sh->bgsave.progress = p;
+    int status;
+    pid_t r = waitpid(sh->bgsave.pid, &status, block ? 0 : WNOHANG);
+    if (r == 0) return;
+    while (read(sh->bgsave.fd, &p, sizeof(p)) == sizeof(p)) sh->bgsave.progress = p;
+    close(sh->bgsave.fd);
+    sh->bgsave.pid = 0;
+    if (r > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        if (sh->wal.active) wal_rebase(sh, sh->bgsave.fork_lsn, sh->bgsave.fork_offset);
+        sh->bgsave.last_secs = now_sec() - sh->bgsave.started;
+        sh->bgsave.last_count = sh->bgsave.progress.done;
+        sh->bgsave.completed++;
+        printf("Background save finished: %zu mappings in %.2fs\n", sh->bgsave.last_count, sh->bgsave.last_secs);
+    } else {
+        sh->bgsave.last_secs = -1;
+        printf("Background save failed.\n");
+    }
+}
+
+// Log the delete of a mapping only the snapshot holds, and stop serving it
+static void snap_remove(shortener_t *sh, long si) {
+    wal_log_delete(sh, sh->snap.entries[si].code);
+    snap_set_gone(sh, (size_t)si);
+}
+
+// Code of a stored URL (in the tables, through its shard l, or the snapshot) into *code
+static int url_lookup(shortener_t *sh, Shard *l, UrlKey *key, uint64_t *code) {
+    if (find_by_long_key(l, key, code)) return 1;
+    long si = snap_find_url(sh, key->url, key->len);
+    if (si < 0) return 0;
+    *code = sh->snap.entries[si].code;
+    return 1;
+}
+
+/* Lease count consecutive sequence numbers starting at *start, logged before
+   they are used. Returns how many were leased: fewer near the end of the
+   space, 0 once every one has been.
+*/
+static uint64_t lease_range(shortener_t *sh, uint64_t count, uint64_t *start) {
+    uint64_t first = __atomic_fetch_add(&sh->global_id, count, __ATOMIC_RELAXED);
+    if (first >= MODULUS) return 0;
+    uint64_t got = MODULUS - first > count ? count : MODULUS - first;
+    wal_log_lease(sh, first + got);
+    *start = first;
+    return got;
+}
+
+/* Next sequence number from shard l's lease (l locked), leasing the next
+   LEASE_BLOCK of them once it runs out, so writers share global_id only once
+   per block. Returns MODULUS once every one has been leased.
+*/
+static uint64_t lease_next_id(shortener_t *sh, Shard *l) {
+    if (l->lease_next == l->lease_end) {
+        uint64_t got = lease_range(sh, LEASE_BLOCK, &l->lease_next);
+        if (!got) return MODULUS;
+        l->lease_end = l->lease_next + got;
+        l->leases++;
+    }
+    return l->lease_next++;
+}
+
+/* Generate short URL. If long URL already present, return existing short code.
+   scramble_id is a bijection on [0, MODULUS) and each sequence number is handed
+   out once, so a fresh code cannot already be in use and needs no probe.
+   The URL's shard stays locked throughout, so no other thread can add the
+   same URL meanwhile; the new code's shard is locked as well to insert.
+   Returns 0 once all MODULUS - 1 sequence numbers have been leased and the
+   URL's shard has used up its lease.
+*/
+static int generate_short_url(shortener_t *sh, const char *long_url, size_t len, char *out_short_code) {
+    UrlKey key;
+    url_key_init(&key, long_url, len);
+    Shard *l = shard_of_url(sh, key.hash);
+    shard_lock(l);
+    uint64_t code;
+    int ok = 1;
+    if (!url_lookup(sh, l, &key, &code)) {
+        uint64_t seq = lease_next_id(sh, l);
+        if (seq < MODULUS) {
+            code = scramble_id(seq);
+            Shard *s = shard_of_code(sh, code);
+            // l may have been let go, and the URL added in between
+            if (shard_lock_second(sh, l, s) || !url_lookup(sh, l, &key, &code))
+                insert_mapping_key(sh, s, l, code, &key);
+            if (s != l) shard_unlock(s);
+        } else {
+            ok = 0;
+        }
+    }
+    shard_unlock(l);
+    if (ok) id_to_base62(code, out_short_code);
+    return ok;
+}
+
+#ifndef GEN_BATCH_CHUNK
+#define GEN_BATCH_CHUNK 16384   // URLs per round of a batch gen
+#endif
+#define GEN_BATCH_PREFETCH 8    // lookups ahead whose first bucket is prefetched
+
+// Start loading the long-index bucket (or home slot) a URL's lookup reads first
+static inline void long_prefetch(Shard *l, uint64_t hash) {
+#ifdef LONG_INDEX_FINGERPRINT
+    __builtin_prefetch(&l->long_index.slots[fp_home(&l->long_index, fp_hi(hash))]);
+#else
+    __builtin_prefetch(head_for(&l->long_table, hash));
+#endif
+}
+
+/* generate_short_url for n URLs, GEN_BATCH_CHUNK per round. A round hashes
+   its URLs unlocked, then with every shard locked looks them all up,
+   prefetching GEN_BATCH_PREFETCH lookups ahead, leases one range of exactly
+   as many sequence numbers as URLs were missing, and inserts those in order
+   (a URL repeated within the round finds its first copy then, and wastes
+   one). The codes are encoded once the round has let go of the locks.
+   Returns how many codes were written: n unless the sequence numbers ran out.
+*/
+static size_t generate_short_urls(shortener_t *sh, const char *const *urls, const size_t *lens, size_t n,
+                                  char *codes) {
+    size_t chunk = n < GEN_BATCH_CHUNK ? n : GEN_BATCH_CHUNK;
+    uint64_t *hashes = malloc(chunk * sizeof(uint64_t));
+    uint64_t *ids = malloc(chunk * sizeof(uint64_t));
+#ifdef LONG_INDEX_FINGERPRINT
+    uint64_t *fps = malloc(chunk * sizeof(uint64_t));
+    if (!fps) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+#endif
+    if (!hashes || !ids) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    UrlKey key;
+    size_t done = 0;
+    while (done < n) {
+        const char *const *u = urls + done;
+        const size_t *len = lens + done;
+        size_t m = n - done < chunk ? n - done : chunk, missing = 0, k;
+        for (size_t j = 0; j < m; ++j) {
+            hashes[j] = hash_url(u[j], len[j]);
+#ifdef LONG_INDEX_FINGERPRINT
+            fps[j] = hash_bytes(u[j], len[j], hash_seed ^ FP_SEED2);
+#endif
+        }
+        shards_lock_all(sh);
+        for (size_t j = 0; j < m; ++j) {
+            if (j + GEN_BATCH_PREFETCH < m) {
+                uint64_t h = hashes[j + GEN_BATCH_PREFETCH];
+                long_prefetch(shard_of_url(sh, h), h);
+            }
+            key.hash = hashes[j];
+#ifdef LONG_INDEX_FINGERPRINT
+            key.fp_lo = fps[j];
+#endif
+            url_key_reset(&key, u[j], len[j]);
+            if (!url_lookup(sh, shard_of_url(sh, key.hash), &key, &ids[j])) {
+                ids[j] = CODE_SPACE;
+                missing++;
+            }
+        }
+        uint64_t next = 0, got = missing ? lease_range(sh, missing, &next) : 0, end = next + got;
+        if (got) sh->batch_leases++;
+        for (k = 0; k < m; ++k) {
+            if (ids[k] != CODE_SPACE) continue;
+            key.hash = hashes[k];
+#ifdef LONG_INDEX_FINGERPRINT
+            key.fp_lo = fps[k];
+#endif
+            // the dictionary may have gained the URL's host since the lookup
+            url_key_reset(&key, u[k], len[k]);
+            Shard *l = shard_of_url(sh, key.hash);
+            if (url_lookup(sh, l, &key, &ids[k])) continue;
+            if (next == end) break;
+            ids[k] = scramble_id(next++);
+            insert_mapping_key(sh, shard_of_code(sh, ids[k]), l, ids[k], &key);
+        }
+        // the rest of the range went to URLs another gen added since the lookup
+        if (got && next > sh->used_end) sh->used_end = next;
+        sh->abandoned += end - next;
+        shards_unlock_all(sh);
+        for (size_t j = 0; j < k; ++j) id_to_base62(ids[j], codes + (done + j) * SHORT_CODE_LEN);
+        done += k;
+        if (k < m) break;
+    }
+    free(hashes);
+    free(ids);
+#ifdef LONG_INDEX_FINGERPRINT
+    free(fps);
+#endif
+    return done;
+}
+
+// Bounded varint read for replay: 0 if the bytes end first or it runs too long
+static size_t wal_get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v) {
+    uint64_t r = 0;
+    for (size_t n = 0; n < 10 && p + n < end; ++n) {
+        r |= (uint64_t)(p[n] & 0x7f) << (7 * n);
+        if (!(p[n] & 0x80)) {
+            *v = r;
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+/* Parse one record at p; returns its length, or 0 if it is cut short, fails
+   its CRC or is malformed. A valid INSERT also yields the URL.
+*/
+static size_t wal_parse(const uint8_t *p, const uint8_t *end, int *type, uint64_t *code,
+                        const char **url, size_t *len) {
+    const uint8_t *q = p;
+    if (q >= end) return 0;
+    *type = *q++;
+    if (*type < WAL_INSERT || *type > WAL_LEASE) return 0;
+    size_t k = wal_get_varint(q, end, code);
+    if (!k) return 0;
+    q += k;
+    if (*type == WAL_INSERT || *type == WAL_IMAGE) {
+        uint64_t l;
+        if (!(k = wal_get_varint(q, end, &l)) || l == 0 || l >= LONG_URL_MAX) return 0;
+        q += k;
+        if ((size_t)(end - q) < l) return 0;
+        *url = (const char *)q;
+        *len = (size_t)l;
+        q += l;
+    }
+    if (end - q < 4) return 0;
+    uint32_t crc = (uint32_t)q[0] | (uint32_t)q[1] << 8 | (uint32_t)q[2] << 16 | (uint32_t)q[3] << 24;
+    if (crc != crc32c(p, (size_t)(q - p))) return 0;
+    return (size_t)(q - p) + 4;
+}
+
+/* Apply a logged mapping (at creation, so no shard is locked). Replay is
+   idempotent: a code that is already mapped (or a URL that already has a
+   code) is left alone, and a delete of a missing code is a no-op. global_id
+   moves past every sequence number seen, deleted or not, and past every
+   leased block, so codes are never handed out twice.
+*/
+static void wal_apply(shortener_t *sh, int type, uint64_t code, const char *url, size_t len) {
+    if (type == WAL_SEQ || type == WAL_LEASE) {
+        if (code > sh->global_id) sh->global_id = code;
+        return;
+    }
+    Shard *s = shard_of_code(sh, code);
+    if (type == WAL_DELETE) {
+        Node *n = find_by_code(s, code);
+        long si = n ? -1 : snap_find_code(sh, code);
+        if (n) remove_node(sh, s, shard_of_url(sh, n->url_hash), n);
+        else if (si >= 0) snap_set_gone(sh, (size_t)si);
+        return;
+    }
+    if (code < MODULUS) {
+        uint64_t seq = unscramble_id(code);
+        if (seq >= sh->global_id) sh->global_id = seq + 1;
+        if (seq >= sh->used_end) sh->used_end = seq + 1;
+    }
+    if (find_by_code(s, code) || snap_find_code(sh, code) >= 0) return;
+    UrlKey key;
+    url_key_init(&key, url, len);
+    Shard *l = shard_of_url(sh, key.hash);
+    uint64_t existing;
+    if (url_lookup(sh, l, &key, &existing)) return;
+    store_mapping(s, l, code, &key);
+}
+
+/* Open (or create) the log and replay it into the empty tables, skipping the
+   records a loaded snapshot already covers. Anything after the last whole,
+   CRC-valid record can only be a write the crash cut short, so the file is
+   truncated there. Returns the number of records replayed.
+*/
+static uint64_t wal_open(shortener_t *sh, const char *path) {
+    sh->wal.path = path;
+    sh->wal.fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    struct stat st;
+    if (sh->wal.fd < 0 || fstat(sh->wal.fd, &st) != 0) {
+        perror(path);
+        exit(1);
+    }
+    size_t size = (size_t)st.st_size;
+    uint8_t *data = malloc(size ? size : 1);
+    if (!data) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t got = 0; got < size;) {
+        ssize_t r = pread(sh->wal.fd, data + got, size - got, (off_t)got);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) continue;
+            perror(path);
+            exit(1);
+        }
+        got += (size_t)r;
+    }
+
+    uint64_t covered = sh->snap.map ? sh->snap.hdr->next_lsn : 0;
+    uint64_t replayed = 0, lsn = covered;
+    if (size < WAL_HEADER_BYTES) {
+        // new (or header never completed): start an empty log at LSN 0
+        uint8_t header[WAL_HEADER_BYTES];
+        if (ftruncate(sh->wal.fd, 0) != 0) {
+            perror(path);
+            exit(1);
+        }
+        wal_write_all(sh, (const char *)header, wal_header(header, covered));
+        wal_sync(sh);
+        sh->wal.base_lsn = covered;
+    } else {
+        if (memcmp(data, WAL_MAGIC, 8) != 0) {
+            fprintf(stderr, "%s: not a write-ahead log\n", path);
+            exit(1);
+        }
+        sh->wal.base_lsn = 0;
+        for (int i = 0; i < 8; ++i) sh->wal.base_lsn |= (uint64_t)data[8 + i] << (8 * i);
+        lsn = sh->wal.base_lsn;
+        const uint8_t *p = data + WAL_HEADER_BYTES, *end = data + size;
+        char url[LONG_URL_MAX];
+        while (p < end) {
+            int type;
+            uint64_t code;
+            const char *u = NULL;
+            size_t len = 0;
+            size_t n = wal_parse(p, end, &type, &code, &u, &len);
+            if (!n) break;
+            if (u) {
+                memcpy(url, u, len);
+                url[len] = '\0';
+            }
+            p += n;
+            if (type == WAL_SEQ || type == WAL_IMAGE) {
+                // the image of a compacted log is as new as its base LSN: it
+                // replaces an older snapshot, and a newer one replaces it
+                if (covered > sh->wal.base_lsn) continue;
+                if (sh->snap.map) {
+                    printf("Snapshot %s is older than the compacted log; not using it\n", sh->snap.path);
+                    snap_close(sh);
+                }
+            } else if (lsn++ < covered) {
+                continue;
+            }
+            wal_apply(sh, type, code, url, len);
+            replayed++;
+        }
+        if (p < end) {
+            fprintf(stderr, "%s: dropping %zu bytes of torn or corrupt tail\n", path, (size_t)(end - p));
+            if (ftruncate(sh->wal.fd, (off_t)(p - data)) != 0) {
+                perror(path);
+                exit(1);
+            }
+            wal_sync(sh);
+        }
+    }
+    free(data);
+    sh->wal.next_lsn = lsn > covered ? lsn : covered;
+    sh->wal.file_bytes = (uint64_t)lseek(sh->wal.fd, 0, SEEK_END);
+    sh->wal.durable_lsn = sh->wal.next_lsn;
+
+    if (sh->wal.policy == FSYNC_ALWAYS) pthread_cond_init(&sh->wal.synced, NULL);
+    if (sh->wal.policy == FSYNC_GROUP) {
+        pthread_cond_init(&sh->wal.wake, NULL);
+        if (pthread_create(&sh->wal.flusher, NULL, wal_flusher, sh) != 0) {
+            fprintf(stderr, "Cannot start WAL flusher\n");
+            exit(1);
+        }
+    }
+    sh->wal.active = 1;
+    return replayed;
+}
+
+/* Clean-up: nodes, URLs and index arrays all go back in whole blocks, after
+   the background work that could still touch them is finished
+*/
+void shortener_destroy(shortener_t *sh) {
+    bgsave_poll(sh, 1);
+    log_compact_abort(sh);
+    wal_close(sh);
+    snap_close(sh);
+    for (unsigned i = 0; i < sh->shard_count; ++i) {
+        Shard *sd = &sh->shards[i];
+        // URLs and nodes both live in large blocks, so everything goes back whole
+        arena_release_all(&sd->url_arena);
+        hostdict_free(&sd->host_dict);
+#ifndef SHORT_INDEX_DENSE
+        slab_release_all(&sd->node_slab);
+#endif
+        //long_table still holds dangling pointers now; drop the arrays entirely 
+#if defined(SHORT_INDEX_SWISS)
+        free(sd->short_index.ctrl);
+        free(sd->short_index.slots);
+#elif defined(SHORT_INDEX_DENSE)
+        dense_free(&sd->short_index);
+#else
+        free(sd->short_table.buckets);
+        free(sd->short_table.old_buckets);
+#endif
+#ifdef LONG_INDEX_FINGERPRINT
+        free(sd->long_index.slots);
+#else
+        free(sd->long_table.buckets);
+        free(sd->long_table.old_buckets);
+#endif
+        // no lookup can be running now, so whatever is still retired goes back too
+        reclaim(sd, 1);
+        free(sd->retired);
+        free(sd->url_symbols);
+        pthread_mutex_destroy(&sd->lock);
+    }
+    free(sh->shards);
+    pthread_mutex_destroy(&sh->wal.lock);
+    pthread_mutex_destroy(&sh->wal.io);
+    pthread_mutex_destroy(&sh->maint);
+    free(sh->snap_path);
+    free(sh->wal_path);
+    free(sh);
+}
+
+// Count non-empty buckets in both tables (keeps previous behavior) 
+void shortener_print_buckets(shortener_t *sh) {
+    size_t short_count = 0, long_count = 0;
+    shards_lock_all(sh);
+    for (unsigned i = 0; i < sh->shard_count; ++i) {
+        const Shard *sd = &sh->shards[i];
+#if defined(SHORT_INDEX_SWISS) || defined(SHORT_INDEX_DENSE)
+        short_count += sd->short_index.count;
+#else
+        short_count += nonempty_buckets(&sd->short_table);
+#endif
+#ifdef LONG_INDEX_CHAINED
+        long_count += nonempty_buckets(&sd->long_table);
+#else
+        long_count += sd->long_index.count;
+#endif
+    }
+    shards_unlock_all(sh);
+    printf("Short_table count->%zu\nLong_table count->%zu\n", short_count, long_count);
+}
+
+#ifdef HAVE_HASH_TABLE
+static const HashTable *shard_table(const Shard *sd, int kind) {
+#if defined(SHORT_INDEX_CHAINED) && defined(LONG_INDEX_CHAINED)
+    return kind == TABLE_SHORT ? &sd->short_table : &sd->long_table;
+#elif defined(SHORT_INDEX_CHAINED)
+    (void)kind;
+    return &sd->short_table;
+#else
+    (void)kind;
+    return &sd->long_table;
+#endif
+}
+
+// One line for the chained table of this kind, added up over the shards
+static void print_table_stats(const shortener_t *sh, const char *name, int kind) {
+    size_t count = 0, size = 0, old_size = 0, moved = 0;
+    for (unsigned i = 0; i < sh->shard_count; ++i) {
+        const HashTable *t = shard_table(&sh->shards[i], kind);
+        count += t->count;
+        size += t->size;
+        if (table_rehashing(t)) {
+            old_size += t->old_size;
+            moved += t->rehash_pos;
+        }
+    }
+    printf("%s %zu entries / %zu buckets (load %.2f)", name, count, size, (double)count / size);
+    if (old_size) printf(", rehashing from %zu buckets (%zu/%zu migrated)", old_size, moved, old_size);
+    printf("\n");
+}
+#endif
+
+// Table sizes, load factors and rehash progress, added up over the shards
+void shortener_print_stats(shortener_t *sh) {
+    pthread_mutex_lock(&sh->maint);
+    shards_lock_all(sh);
+    size_t reverse_bytes = 0, node_bytes = 0, retired = 0;
+    size_t segments = 0, segment_bytes = 0, live_bytes = 0, dead_bytes = 0, inline_urls = 0, passes = 0, compacting = 0;
+    size_t prefixes = 0, prefix_bytes = 0, dict_bytes = 0;
+    unsigned symbols = 0, tables = 0;
+    uint64_t locks = 0, waits = 0, leases = 0, unused = 0;
+#if defined(SHORT_INDEX_SWISS)
+    size_t short_count = 0, short_size = 0, tombstones = 0;
+#elif defined(SHORT_INDEX_DENSE)
+    size_t short_count = 0, short_size = 0;
+#endif
+#ifdef LONG_INDEX_FINGERPRINT
+    size_t long_count = 0, long_size = 0;
+#endif
+#ifndef SHORT_INDEX_DENSE
+    size_t slab_live = 0, chunks = 0;
+#endif
+    for (unsigned i = 0; i < sh->shard_count; ++i) {
+        const Shard *sd = &sh->shards[i];
+#if defined(SHORT_INDEX_SWISS)
+        short_count += sd->short_index.count;
+        short_size += sd->short_index.capacity;
+        tombstones += sd->short_index.tombstones;
+#elif defined(SHORT_INDEX_DENSE)
+        short_count += sd->short_index.count;
+        short_size += sd->short_index.segments;
+        node_bytes += sd->short_index.segments * DENSE_SEG_NODES * sizeof(Node);
+#endif
+#ifdef LONG_INDEX_CHAINED
+        // bucket arrays plus the next_long link in every node
+        reverse_bytes += (sd->long_table.size + sd->long_table.old_size + sd->long_table.count) * sizeof(Node *);
+#else
+        long_count += sd->long_index.count;
+        long_size += sd->long_index.capacity;
+        reverse_bytes += sd->long_index.capacity * sizeof(FpEntry);
+#endif
+#ifndef SHORT_INDEX_DENSE
+        slab_live += sd->node_slab.live;
+        chunks += sd->node_slab.chunk_count;
+        node_bytes += sd->node_slab.chunk_count * slab_chunk_bytes();
+#endif
+        segments += sd->url_arena.segments;
+        segment_bytes += sd->url_arena.segments * sd->url_arena.seg_bytes;
+        live_bytes += sd->url_arena.live_bytes;
+        dead_bytes += sd->url_arena.dead_bytes;
+        inline_urls += sd->url_arena.inline_urls;
+        passes += sd->url_arena.passes;
+        compacting += sd->url_arena.compacting;
+        prefixes += sd->host_dict.live;
+        prefix_bytes += sd->host_dict.bytes;
+        dict_bytes += sd->host_dict.bytes + sd->host_dict.cap * sizeof(HostEntry) +
+                      sd->host_dict.nbuckets * sizeof(int32_t);
+        if (sd->url_symbols && sd->url_symbols->count) tables++;
+        if (sd->url_symbols && sd->url_symbols->count > symbols) symbols = sd->url_symbols->count;
+        retired += sd->retired_count;
+        locks += sd->locks;
+        waits += sd->waits;
+        leases += sd->leases;
+        unused += sd->lease_end - sd->lease_next;
+    }
+#if defined(SHORT_INDEX_SWISS)
+    printf("Short_index: %zu entries / %zu slots (load %.2f, %zu tombstones, %d-byte groups)\n",
+           short_count, short_size, (double)short_count / short_size, tombstones, GROUP_WIDTH);
+#elif defined(SHORT_INDEX_DENSE)
+    printf("Short_index: %zu entries in %zu dense segments of %llu nodes\n", short_count, short_size, DENSE_SEG_NODES);
+#else
+    print_table_stats(sh, "Short_table:", TABLE_SHORT);
+#endif
+#ifdef LONG_INDEX_CHAINED
+    print_table_stats(sh, "Long_table: ", TABLE_LONG);
+#else
+    printf("Long_index:  %zu entries / %zu slots (load %.2f, %zu-byte fingerprint entries)\n",
+           long_count, long_size, (double)long_count / long_size, sizeof(FpEntry));
+#endif
+#ifndef SHORT_INDEX_DENSE
+    printf("Node slab:   %zu live nodes in %zu chunks of %d (%zu bytes each, %zu bytes per node)\n",
+           slab_live, chunks, SLAB_CHUNK_NODES, slab_chunk_bytes(), sizeof(Node));
+#endif
+    printf("URL arena:   %zu segments of %u KB, %zu live / %zu dead bytes, %zu URLs inline (<= %d bytes)%s, %zu compactions\n",
+           segments, sh->shards[0].url_arena.seg_bytes >> 10, live_bytes, dead_bytes, inline_urls, INLINE_URL_MAX, compacting ? ", compacting" : "", passes);
+    if (sh->compress_hosts)
+        printf("Host dict:   %zu prefixes, %zu bytes\n", prefixes, prefix_bytes);
+    if (symbols)
+        printf("Symbols:     %u trained (%zu bytes)\n", symbols, tables * sizeof(SymbolTable));
+    size_t raw, stored;
+    url_bytes(sh, &raw, &stored);
+    if (stored)
+        printf("URL bytes:   %zu raw / %zu stored (ratio %.2f)\n", raw, stored, (double)raw / stored);
+    size_t mappings = mapping_count(sh);
+    if (mappings)
+        printf("Reverse map: %.1f bytes per mapping\n", (double)reverse_bytes / mappings);
+    if (mappings)
+        printf("Memory:      %.1f bytes per mapping (nodes + arena + reverse map%s)\n",
+               (double)(node_bytes + segment_bytes + reverse_bytes + dict_bytes) / mappings,
+               sh->compress_hosts ? " + host dict" : "");
+    if (sh->snap.map)
+        printf("Snapshot:    %zu of %llu mappings still served from %s (warm-up at %zu)\n",
+               sh->snap.live, (unsigned long long)sh->snap.hdr->count, sh->snap.path, sh->snap.warm_pos);
+    if (sh->bgsave.pid)
+        printf("Bgsave:      running (pid %d), %llu/%llu URLs written, %.2fs so far, fork took %.1f ms\n",
+               (int)sh->bgsave.pid, (unsigned long long)sh->bgsave.progress.done,
+               (unsigned long long)sh->bgsave.progress.total, now_sec() - sh->bgsave.started, sh->bgsave.fork_ms);
+    else if (sh->bgsave.completed)
+        printf("Bgsave:      %u done; last %s, %zu mappings in %.2fs, fork took %.1f ms\n", sh->bgsave.completed,
+               sh->bgsave.last_secs < 0 ? "failed" : "ok", sh->bgsave.last_count,
+               sh->bgsave.last_secs < 0 ? 0 : sh->bgsave.last_secs, sh->bgsave.fork_ms);
+    if (sh->log_compaction.running) {
+        pthread_mutex_lock(&sh->log_compaction.lock);
+        uint64_t written = sh->log_compaction.written;
+        pthread_mutex_unlock(&sh->log_compaction.lock);
+        printf("Compaction:  running, %zu mappings imaged, %llu bytes written, %.2fs so far\n",
+               sh->log_compaction.images, (unsigned long long)written, now_sec() - sh->log_compaction.started);
+    } else if (sh->log_compaction.completed)
+        printf("Compaction:  %u done; last took the log from %llu to %llu bytes in %.2fs\n",
+               sh->log_compaction.completed, (unsigned long long)sh->log_compaction.last_before,
+               (unsigned long long)sh->log_compaction.last_after, sh->log_compaction.last_secs);
+    if (sh->wal.active) {
+        static const char *policies[] = { "always", "group", "os" };
+        if (sh->wal.policy == FSYNC_GROUP) pthread_mutex_lock(&sh->wal.lock);
+        printf("WAL:         %s, fsync %s, next LSN %llu, %llu bytes appended, %llu syncs, %llu bytes on disk\n",
+               sh->wal.path, policies[sh->wal.policy], (unsigned long long)sh->wal.next_lsn,
+               (unsigned long long)sh->wal.bytes, (unsigned long long)sh->wal.syncs,
+               (unsigned long long)sh->wal.file_bytes);
+        if (sh->wal.policy == FSYNC_GROUP) pthread_mutex_unlock(&sh->wal.lock);
+    }
+    // sequence numbers start at 1, and the counter runs past MODULUS once they are all leased
+    uint64_t leased = (sh->global_id < MODULUS ? sh->global_id : MODULUS) - 1;
+    printf("IDs:         %llu of %llu leased, highest handed out %llu, %llu left in open leases, %llu abandoned; "
+           "%llu blocks of %u and %llu batch ranges leased\n",
+           (unsigned long long)leased, MODULUS - 1, (unsigned long long)(ids_used_end(sh) - 1),
+           (unsigned long long)unused, (unsigned long long)sh->abandoned, (unsigned long long)leases, LEASE_BLOCK,
+           (unsigned long long)sh->batch_leases);
+    // this call's own acquisitions included
+    printf("Shards:      %u, %llu lock acquisitions (%.1f%% waited), %llu gen/del on two shards (%llu backed off)\n",
+           sh->shard_count, (unsigned long long)locks, locks ? 100.0 * waits / locks : 0.0,
+           (unsigned long long)__atomic_load_n(&sh->cross, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&sh->backoffs, __ATOMIC_RELAXED));
+    printf("Readers:     %llu lookups retried, %zu blocks awaiting reclaim\n",
+           (unsigned long long)__atomic_load_n(&sh->read_retries, __ATOMIC_RELAXED), retired);
+    shards_unlock_all(sh);
+    pthread_mutex_unlock(&sh->maint);
+}
+
+/* Work done between commands so resizes finish without taxing later requests.
+   Each shard's own work (resizes, arena compaction) runs under its lock
+   alone, on its share of the time budget; the rest takes every lock, except
+   log compaction, which takes them one short step at a time.
+   Returns 1 while some of it is left.
+*/
+static int idle_maintenance(shortener_t *sh) {
+    int more = 0;
+    long share = (long)sh->shard_count;
+    for (unsigned i = 0; i < sh->shard_count; ++i) {
+        Shard *sd = &sh->shards[i];
+        shard_lock(sd);
+#ifdef SHORT_INDEX_CHAINED
+        table_rehash_idle(sd, &sd->short_table, IDLE_REHASH_US / share);
+        more |= table_rehashing(&sd->short_table);
+#endif
+#ifdef LONG_INDEX_CHAINED
+        table_rehash_idle(sd, &sd->long_table, IDLE_REHASH_US / share);
+        more |= table_rehashing(&sd->long_table);
+#endif
+        arena_compact_idle(sd, &sd->url_arena, IDLE_COMPACT_US / share);
+        more |= sd->url_arena.compacting;
+        shard_unlock(sd);
+    }
+    // another thread is at it already
+    if (pthread_mutex_trylock(&sh->maint) != 0) return 1;
+    shards_lock_all(sh);
+    snap_warm_idle(sh, IDLE_WARM_US);
+    bgsave_poll(sh, 0);
+    if (!sh->bgsave.pid && log_compact_due(sh)) log_compact_start(sh);
+    wal_idle(sh);
+    for (unsigned i = 0; i < sh->shard_count; ++i) reclaim(&sh->shards[i], 0);
+    shards_unlock_all(sh);
+    log_compact_idle(sh, IDLE_LOG_COMPACT_US);
+    more |= sh->snap.map || sh->log_compaction.running;
+    pthread_mutex_unlock(&sh->maint);
+    return more;
+}
+
+/* Library entry points (shortener.h). The handle carries everything, so
+   these check arguments, take the shard locks they need (none for
+   shortener_get) and translate to the functions above.
+*/
+static pthread_once_t process_once = PTHREAD_ONCE_INIT;
+
+static void process_init() {
+    init_hash_seed();
+    crc32c_init();
+    pthread_key_create(&reader_key, reader_thread_exit);
+}
+
+void shortener_options_init(shortener_options_t *o) {
+    memset(o, 0, sizeof(*o));
+    o->capacity = INITIAL_CAPACITY;
+    o->rehash_step = REHASH_STEP;
+    o->fsync = SHORTENER_FSYNC_GROUP;
+    o->group_ms = WAL_GROUP_MS;
+    o->shards = 1;
+}
+
+static char *dup_path(const char *path) {
+    if (!path) return NULL;
+    char *p = strdup(path);
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+shortener_t *shortener_create(const shortener_options_t *o) {
+    pthread_once(&process_once, process_init);
+    shortener_t *sh = calloc(1, sizeof(shortener_t));
+    if (!sh) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    unsigned shards = 1;
+    while (shards < o->shards && shards < SHARDS_MAX) shards <<= 1;
+    sh->shard_count = shards;
+    sh->shard_bits = (unsigned)__builtin_ctz(shards);
+    sh->shards = aligned_alloc(64, shards * sizeof(Shard));
+    if (!sh->shards) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    memset(sh->shards, 0, shards * sizeof(Shard));
+    // the initial capacity is the whole store's, spread over the shards
+    size_t capacity = o->capacity ? o->capacity : INITIAL_CAPACITY;
+    sh->initial_capacity = capacity / shards ? capacity / shards : 1;
+    sh->rehash_step = o->rehash_step;
+    sh->global_id = 1;
+    sh->used_end = 1;
+    sh->compress_hosts = o->host_dict;
+    sh->wal = (Wal){ .fd = -1, .policy = o->fsync, .group_ms = o->group_ms > 0 ? o->group_ms : WAL_GROUP_MS };
+    pthread_mutex_init(&sh->wal.lock, NULL);
+    pthread_mutex_init(&sh->wal.io, NULL);
+    pthread_mutex_init(&sh->maint, NULL);
+    sh->log_compaction.fd = -1;
+    sh->bgsave.last_secs = -1;
+    for (unsigned i = 0; i < shards; ++i) {
+        Shard *sd = &sh->shards[i];
+        pthread_mutex_init(&sd->lock, NULL);
+        sd->sh = sh;
+        sd->host_dict.free_id = -1;
+        sd->url_arena.seg_bytes = ARENA_SEG_BYTES / shards > ARENA_SEG_MIN ? ARENA_SEG_BYTES / shards : ARENA_SEG_MIN;
+#if defined(SHORT_INDEX_SWISS)
+        swiss_init(&sd->short_index, sh->initial_capacity);
+#elif defined(SHORT_INDEX_CHAINED)
+        table_init(&sd->short_table, TABLE_SHORT, sh->initial_capacity);
+#endif
+#ifdef LONG_INDEX_CHAINED
+        table_init(&sd->long_table, TABLE_LONG, sh->initial_capacity);
+#else
+        fp_init(&sd->long_index, sh->initial_capacity);
+#endif
+    }
+    sh->snap_path = dup_path(o->snapshot);
+    sh->wal_path = dup_path(o->wal);
+    if (sh->snap_path) {
+        double t0 = now_sec();
+        size_t n = snap_open(sh, sh->snap_path);
+        if (n) printf("Mapped %zu mappings from %s in %.1f ms\n", n, sh->snap_path, (now_sec() - t0) * 1e3);
+    }
+    if (sh->wal_path) {
+        uint64_t n = wal_open(sh, sh->wal_path);
+        printf("Replayed %llu log records from %s\n", (unsigned long long)n, sh->wal_path);
+    }
+    // leases open when the store stopped are never handed out; what they held past the highest used is lost
+    uint64_t leased = sh->global_id < MODULUS ? sh->global_id : MODULUS;
+    sh->abandoned = leased > sh->used_end ? leased - sh->used_end : 0;
+    return sh;
+}
+
+int shortener_gen(shortener_t *sh, const char *url, size_t len, char *code) {
+    if (len == 0 || len >= LONG_URL_MAX) return SHORTENER_EINVAL;
+    int ok = generate_short_url(sh, url, len, code);
+    wal_commit(sh);
+    return ok ? SHORT_CODE_LEN : SHORTENER_EFULL;
+}
+
+long shortener_gen_batch(shortener_t *sh, const char *const *urls, const size_t *lens, size_t n, char *codes) {
+    for (size_t i = 0; i < n; ++i)
+        if (lens[i] == 0 || lens[i] >= LONG_URL_MAX) return SHORTENER_EINVAL;
+    size_t done = generate_short_urls(sh, urls, lens, n, codes);
+    wal_commit(sh);
+    return done || !n ? (long)done : SHORTENER_EFULL;
+}
+
+long shortener_get(shortener_t *sh, const char *code, size_t len, char *url, size_t cap) {
+    uint64_t id;
+    if (!base62_to_id(code, len, &id)) return -1;
+    const Shard *sd = shard_of_code(sh, id);
+    char buf[READ_BUF_BYTES];
+    ReaderRecord *r = reader_record();
+    reader_enter(r);
+    long l;
+    for (;;) {
+        unsigned s = read_begin(sd);
+        const Node *n;
+        if (!read_find(sd, id, s, &n)) l = READ_AGAIN;
+        else if (n) {
+            Node h;
+            h.url_word = LOAD_SHARED(n->url_word);
+            l = cap ? read_url(sd, n, s, buf) : (long)h.url_len;
+        }
+        else l = read_snap(sh, sd, id, s, buf); // not in the tables yet: answer from the snapshot
+        if (l != READ_AGAIN && read_valid(sd, s)) break;
+        __atomic_fetch_add(&sh->read_retries, 1, __ATOMIC_RELAXED);
+    }
+    reader_exit(r);
+    if (l > 0) memcpy(url, buf, (size_t)l < cap ? (size_t)l : cap);
+    return l;
+}
+
+int shortener_del(shortener_t *sh, const char *code, size_t len) {
+    uint64_t id;
+    if (!base62_to_id(code, len, &id)) return 0;
+    Shard *s = shard_of_code(sh, id), *l = s;
+    shard_lock(s);
+    Node *node;
+    // the URL's shard is only known once the node is found, and taking it may mean letting go of s
+    for (;;) {
+        node = find_by_code(s, id);
+        Shard *want = node ? shard_of_url(sh, node->url_hash) : l;
+        if (want == l) break;
+        if (l != s) shard_unlock(l);
+        l = want;
+        if (shard_lock_second(sh, s, l)) break;
+    }
+    long si = node ? -1 : snap_find_code(sh, id);
+    if (node) remove_node(sh, s, l, node);
+    else if (si >= 0) snap_remove(sh, si);
+    if (l != s) shard_unlock(l);
+    shard_unlock(s);
+    wal_commit(sh);
+    return node || si >= 0;
+}
+
+size_t shortener_count(shortener_t *sh) {
+    shards_lock_all(sh);
+    size_t n = mapping_count(sh) + sh->snap.live;
+    shards_unlock_all(sh);
+    return n;
+}
+
+void shortener_foreach(shortener_t *sh, shortener_visit_fn fn, void *arg) {
+    char code[SHORT_CODE_LEN + 1];
+    char url[LONG_URL_MAX + SYM_DECODE_SLACK];
+    code[SHORT_CODE_LEN] = '\0';
+    shards_lock_all(sh);
+    NodeCursor c;
+    cursor_start(&c, sh->shards, sh->shards + sh->shard_count);
+    int stop = 0;
+    for (Node *n; !stop && (n = cursor_next(&c));) {
+        id_to_base62(n->code, code);
+        stop = fn(arg, code, url, node_read_url(c.shard, n, url));
+    }
+    for (size_t i = 0; !stop && sh->snap.map && i < sh->snap.hdr->count; ++i) {
+        if (snap_gone(sh, i)) continue;
+        size_t len;
+        const char *u = snap_url(sh, i, &len);
+        id_to_base62(sh->snap.entries[i].code, code);
+        stop = fn(arg, code, u, len);
+    }
+    shards_unlock_all(sh);
+}
+
+int shortener_idle(shortener_t *sh) {
+    return idle_maintenance(sh);
+}
+
+void shortener_detach_log(shortener_t *sh) {
+    shards_lock_all(sh);
+    sh->wal.active = 0;
+    shards_unlock_all(sh);
+}
+
+long shortener_save(shortener_t *sh) {
+    if (!sh->snap_path) return SHORTENER_ENOFILE;
+    pthread_mutex_lock(&sh->maint);
+    shards_lock_all(sh);
+    long n = SHORTENER_EBUSY;
+    if (!sh->bgsave.pid) {
+        log_compact_abort(sh);
+        wal_lock_all(sh);
+        if (sh->wal.active) wal_flush(sh, 0);
+        uint64_t lsn = sh->wal.next_lsn;
+        off_t offset = sh->wal.active ? lseek(sh->wal.fd, 0, SEEK_END) : 0;
+        wal_unlock_all(sh);
+        n = snap_save(sh, sh->snap_path, NULL);
+        if (n < 0) n = SHORTENER_EFAIL;
+        else if (sh->wal.active) wal_rebase(sh, lsn, offset);
+    }
+    shards_unlock_all(sh);
+    pthread_mutex_unlock(&sh->maint);
+    return n;
+}
+
+long shortener_bgsave(shortener_t *sh) {
+    if (!sh->snap_path) return SHORTENER_ENOFILE;
+    pthread_mutex_lock(&sh->maint);
+    shards_lock_all(sh);
+    long r = SHORTENER_ERUNNING;
+    if (!sh->bgsave.pid) r = bgsave_start(sh, sh->snap_path) ? (long)sh->bgsave.pid : SHORTENER_EFAIL;
+    shards_unlock_all(sh);
+    pthread_mutex_unlock(&sh->maint);
+    return r;
+}
+
+int shortener_compact(shortener_t *sh) {
+    pthread_mutex_lock(&sh->maint);
+    shards_lock_all(sh);
+    int r;
+    if (!sh->wal.active) r = SHORTENER_ENOFILE;
+    else if (sh->log_compaction.running) r = SHORTENER_ERUNNING;
+    else if (sh->bgsave.pid) r = SHORTENER_EBUSY;
+    // the shard locks keep appends (and so file_bytes) still
+    else if (log_image_bytes(sh) >= sh->wal.file_bytes) r = 0;
+    else r = log_compact_start(sh) ? 1 : SHORTENER_EFAIL;
+    shards_unlock_all(sh);
+    pthread_mutex_unlock(&sh->maint);
+    return r;
+}
+
+unsigned shortener_train(shortener_t *sh) {
+    return train_url_symbols(sh);
+}
+
+void shortener_url_bytes(shortener_t *sh, size_t *raw, size_t *stored) {
+    shards_lock_all(sh);
+    url_bytes(sh, raw, stored);
+    shards_unlock_all(sh);
+}
+
+uint64_t shortener_hash(const void *p, size_t len) {
+    pthread_once(&process_once, process_init);
+    return hash_bytes(p, len, hash_seed);
+}
+
+uint64_t shortener_hash_djb2(const void *p, size_t len) {
+    return hash_djb2(p, len);
+}
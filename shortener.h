@@ -0,0 +1,139 @@
+/* libshortener: the URL shortener store behind the CLI and the HTTP server.
+
+   A shortener_t is one store: both indexes, the URL storage, and optionally
+   a write-ahead log and a snapshot file. Nothing is shared between handles,
+   so independent stores can run side by side (one per shard or per core).
+
+   Any call may come from any thread. shortener_get takes no lock and never
+   waits for a writer except while shortener_train recodes the URLs. A store
+   is split into shards, each under its own lock: shortener_gen and
+   shortener_del lock the one or two shards the code and URL hash to, so
+   writers on different shards run side by side, and every other call holds
+   all of the locks. shortener_destroy must not overlap any call, and a
+   shortener_foreach callback runs under the locks so it must not call back
+   into the same store.
+
+   Codes are SHORTENER_CODE_LEN base62 characters and are passed with their
+   length; nothing here needs them NUL-terminated. Functions that produce a
+   URL or code return its length and do not terminate it either.
+*/
+#ifndef SHORTENER_H
+#define SHORTENER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHORTENER_CODE_LEN 7
+#define SHORTENER_URL_MAX 1024    // URLs are shorter than this
+
+// Returned in place of a length or count
+#define SHORTENER_EFAIL (-1)      // failed; the reason went to stderr
+#define SHORTENER_EINVAL (-2)     // empty URL, or one of SHORTENER_URL_MAX bytes or more
+#define SHORTENER_EFULL (-3)      // every short code has been handed out
+#define SHORTENER_ENOFILE (-4)    // the store was created without the file this needs
+#define SHORTENER_EBUSY (-5)      // a background save is running
+#define SHORTENER_ERUNNING (-6)   // already running
+
+enum { SHORTENER_FSYNC_ALWAYS, SHORTENER_FSYNC_GROUP, SHORTENER_FSYNC_OS };
+
+typedef struct shortener shortener_t;
+
+typedef struct shortener_options {
+    size_t capacity;        // initial bucket count (over all shards), rounded up to a power of two
+    size_t rehash_step;     // old buckets migrated per operation while resizing; 0 resizes in one pass
+    int host_dict;          // store scheme://host prefixes once
+    const char *snapshot;   // mapped and served at creation, written by save; NULL for none
+    const char *wal;        // replayed at creation, appended to by every change; NULL for none
+    int fsync;              // SHORTENER_FSYNC_*: when a logged change is durable
+    long group_ms;          // SHORTENER_FSYNC_GROUP: sync interval
+    unsigned shards;        // independently locked shards, rounded up to a power of two (at most 256)
+} shortener_options_t;
+
+// Defaults: no files, group commit every 10 ms, one shard
+void shortener_options_init(shortener_options_t *o);
+
+/* Create a store, mapping the snapshot and replaying the log if given (and
+   reporting both on stdout). Exits on out of memory, like every call here.
+*/
+shortener_t *shortener_create(const shortener_options_t *o);
+
+// Wait for a background save, sync the log and free everything
+void shortener_destroy(shortener_t *sh);
+
+/* Short code for url (len bytes) into code (SHORTENER_CODE_LEN bytes): the
+   existing one if the URL is stored, else a new one. Returns
+   SHORTENER_CODE_LEN, SHORTENER_EINVAL or SHORTENER_EFULL.
+*/
+int shortener_gen(shortener_t *sh, const char *url, size_t len, char *code);
+
+/* shortener_gen for n URLs at once (urls[i] of lens[i] bytes), with the i-th
+   code at codes + i * SHORTENER_CODE_LEN. Codes for new URLs come from
+   consecutive sequence numbers, and other writers wait while each round of
+   the batch is stored. Returns the number of codes written (n unless they ran
+   out partway), SHORTENER_EINVAL without storing anything if any URL is
+   invalid, or SHORTENER_EFULL if none were left.
+*/
+long shortener_gen_batch(shortener_t *sh, const char *const *urls, const size_t *lens, size_t n, char *codes);
+
+/* URL behind a code into url, writing at most cap bytes. Returns its full
+   length (more than cap if it was cut short), or -1 if there is no mapping;
+   a cap of 0 only checks for one.
+*/
+long shortener_get(shortener_t *sh, const char *code, size_t len, char *url, size_t cap);
+
+// Delete a mapping; returns 1, or 0 if there was none
+int shortener_del(shortener_t *sh, const char *code, size_t len);
+
+// Live mappings
+size_t shortener_count(shortener_t *sh);
+
+/* Call fn for every mapping (those still served from the snapshot last)
+   until it returns nonzero
+*/
+typedef int (*shortener_visit_fn)(void *arg, const char *code, const char *url, size_t len);
+void shortener_foreach(shortener_t *sh, shortener_visit_fn fn, void *arg);
+
+/* Background work in bounded steps: finishing resizes, arena compaction,
+   snapshot warm-up, log compaction, reaping a background save. Call it
+   between requests; returns 1 while some is left.
+*/
+int shortener_idle(shortener_t *sh);
+
+// Stop logging: for a forked child that must leave the log to its parent
+void shortener_detach_log(shortener_t *sh);
+
+/* Write every mapping to the snapshot file, then drop the log records it
+   covers. Returns the number saved, SHORTENER_ENOFILE, SHORTENER_EBUSY or
+   SHORTENER_EFAIL.
+*/
+long shortener_save(shortener_t *sh);
+
+/* Start the same save in a forked child; shortener_idle reaps it. Returns its
+   pid, SHORTENER_ENOFILE, SHORTENER_ERUNNING or SHORTENER_EFAIL.
+*/
+long shortener_bgsave(shortener_t *sh);
+
+/* Start rewriting the log as just the live mappings (also started by
+   shortener_idle once the log outgrows them). Returns 1 once started, 0 if
+   the log is already no bigger than that would make it, SHORTENER_ENOFILE,
+   SHORTENER_ERUNNING, SHORTENER_EBUSY or SHORTENER_EFAIL.
+*/
+int shortener_compact(shortener_t *sh);
+
+/* Train the URL symbol table on the stored URLs and recode them; returns the
+   symbols trained. Lookups retry while their shard is being recoded.
+*/
+unsigned shortener_train(shortener_t *sh);
+
+// Total length of the live URLs, and of their stored (compressed) forms
+void shortener_url_bytes(shortener_t *sh, size_t *raw, size_t *stored);
+
+// The "stats" and "count" reports, on stdout
+void shortener_print_stats(shortener_t *sh);
+void shortener_print_buckets(shortener_t *sh);
+
+// The string hashes the indexes use (seeded per process) and djb2, for benchmarks
+uint64_t shortener_hash(const void *p, size_t len);
+uint64_t shortener_hash_djb2(const void *p, size_t len);
+
+#endif